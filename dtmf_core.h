@@ -0,0 +1,366 @@
+/**
+ * @file   dtmf_core.h
+ * @author CK Lui
+ * @date   Jan 9, 2018
+ * @description
+ * The hardware independent core of the MT88L70 DTMF receiver driver: the decode table, the StD
+ * edge classifier, the sequence assembler, the pattern matcher, the writer side of the event ring,
+ * the IRQ rate window and the histogram buckets. None of it touches a GPIO, a lock or a timer --
+ * the caller passes in the samples and timestamps and holds whatever lock protects the state -- so
+ * the same code is built into the module and into a userspace program that replays recorded or
+ * generated StD/Q1..Q4 traffic to test and benchmark it.
+ * Everything is static inline, there is nothing to link.
+*/
+#ifndef DTMF_CORE_H
+#define DTMF_CORE_H
+
+#include "dtmf_rx.h"          // struct dtmf_event
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>     // fls64()
+#include <linux/string.h>     // memset()
+#include <linux/compiler.h>   // WRITE_ONCE()
+#include <asm/barrier.h>      // smp_wmb(), smp_store_release()
+#define dtmf_core_wmb()                  smp_wmb()
+#define dtmf_core_store(p, v)            WRITE_ONCE(*(p), v)
+#define dtmf_core_store_release(p, v)    smp_store_release(p, v)
+#else
+#include <string.h>
+#define dtmf_core_wmb()                  __atomic_thread_fence(__ATOMIC_RELEASE)
+#define dtmf_core_store(p, v)            __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define dtmf_core_store_release(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+/** @brief The MT88L70 output code Q4..Q1 (table 1 of the data sheet) mapped to the ASCII key.
+ *  Every 4-bit code is a valid key, 0000 is 'D' and 1010 is '0'.
+ */
+static const char dtmf_core_keys[16] = {
+   'D', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '*', '#', 'A', 'B', 'C'
+};
+
+/** @brief Decodes a Q4..Q1 code into its ASCII key */
+static inline char dtmf_core_key(__u8 nibble)
+{
+   return dtmf_core_keys[nibble & 0x0f];
+}
+
+/** @brief Encodes an ASCII key into its Q4..Q1 code
+ *  @return the code, or -1 if the character is not a DTMF key
+ */
+static inline int dtmf_core_nibble(char key)
+{
+   int i;
+
+   for (i = 0; i < 16; i++)
+      if (dtmf_core_keys[i] == key) return i;
+   return -1;
+}
+
+/// What an StD sample means, returned by dtmf_core_edge()
+#define DTMF_CORE_GLITCH   0     ///< StD is at the level of the last edge, the pulse was missed or was too short
+#define DTMF_CORE_EDGE     1     ///< An edge that only times the tone
+#define DTMF_CORE_TONE     2     ///< The edge that latches a tone, Q1..Q4 must be sampled
+
+/** @brief Classifies the StD level sampled after an interrupt or a timer
+ *  @param std_level the level of the last edge, updated if this is an edge
+ *  @param level the StD level just sampled, 0 or 1
+ *  @param decode_level the level after the edge that latches a tone, 1 for the rising edge
+ *  @return DTMF_CORE_GLITCH, DTMF_CORE_EDGE or DTMF_CORE_TONE
+ */
+static inline int dtmf_core_edge(__u8 *std_level, __u8 level, __u8 decode_level)
+{
+   if (level == *std_level) return DTMF_CORE_GLITCH;
+   *std_level = level;
+   return level == decode_level ? DTMF_CORE_TONE : DTMF_CORE_EDGE;
+}
+
+/** @brief Software edge detection of polling mode -- a level is only taken once two samples agree
+ *  @param poll_level the previous sample, updated
+ *  @param std_level the level of the last edge
+ *  @param level the StD level just sampled, 0 or 1
+ *  @return 1 if StD is still moving, 2 if it settled at a new level (an edge), 0 otherwise
+ */
+static inline int dtmf_core_poll(__u8 *poll_level, __u8 std_level, __u8 level)
+{
+   if (level != *poll_level) {
+      *poll_level = level;
+      return 1;
+   }
+   return level != std_level ? 2 : 0;
+}
+
+/** @brief The state of the sequence assembler -- the record being collected */
+struct dtmf_core_seq {
+   struct dtmf_event event;      ///< type, digits[] and len of the sequence so far, ts_ns of its first key
+};
+
+/** @brief Completes the sequence being collected
+ *  @param terminator the key that completed it, 0 if it timed out or is full
+ *  @param out receives the DTMF_EVENT_SEQUENCE record, seq is left to the caller
+ *  @return 1 if there is a record to queue, 0 if nothing was collected
+ */
+static inline int dtmf_core_seq_flush(struct dtmf_core_seq *seq, char terminator, struct dtmf_event *out)
+{
+   if (!seq->event.len && !terminator) return 0;
+   *out = seq->event;
+   out->type = DTMF_EVENT_SEQUENCE;
+   out->digit = terminator;
+   memset(&seq->event, 0, sizeof(seq->event));
+   return 1;
+}
+
+/** @brief Adds a key to the sequence being collected
+ *  The sequence is complete when the terminator arrives or DTMF_SEQ_MAX keys were collected.
+ *  @param ts_ns the time of the key
+ *  @param digit the ASCII key
+ *  @param terminator the key that completes a sequence at once, 0 for none
+ *  @param out receives the DTMF_EVENT_SEQUENCE record if the sequence is complete
+ *  @return 1 if out holds a complete sequence, 0 if the key was collected
+ */
+static inline int dtmf_core_seq_add(struct dtmf_core_seq *seq, __u64 ts_ns, char digit, char terminator,
+                                    struct dtmf_event *out)
+{
+   if (terminator && digit == terminator) return dtmf_core_seq_flush(seq, digit, out);
+   if (!seq->event.len) seq->event.ts_ns = ts_ns;   // The sequence starts with this key
+   seq->event.digits[seq->event.len++] = digit;
+   if (seq->event.len == DTMF_SEQ_MAX) return dtmf_core_seq_flush(seq, 0, out);
+   return 0;
+}
+
+/** @brief When the sequence being collected times out, after a key that did not complete it
+ *  @param ts_ns the time of the last key
+ *  @param timeout_us the inter-digit timeout
+ *  @param max_us the completion timeout from the first key, 0 for none
+ *  @return the CLOCK_MONOTONIC time in ns
+ */
+static inline __u64 dtmf_core_seq_expires(const struct dtmf_core_seq *seq, __u64 ts_ns,
+                                          __u32 timeout_us, __u32 max_us)
+{
+   __u64 expires = ts_ns + (__u64)timeout_us * 1000;
+   __u64 complete = seq->event.ts_ns + (__u64)max_us * 1000;
+
+   return max_us && complete < expires ? complete : expires;
+}
+
+/** @brief A state of the pattern matcher, an Aho-Corasick automaton over the 16 Q4..Q1 codes
+ *  next[] already includes the failure transitions, so every key is one table lookup however many
+ *  patterns there are. State 0 is the start state.
+ */
+struct dtmf_core_ac_state {
+   __u16 next[16];               ///< The state after each Q4..Q1 code
+   __u16 dict;                   ///< The longest proper suffix state that completes a pattern, 0 for none
+   __s16 pattern;                ///< The index of the pattern this state completes, -1 for none
+};
+
+/** @brief Checks a set of patterns and counts the states of their matcher
+ *  @return the number of states to allocate, or -1 if a pattern is empty, too long or not made of DTMF keys
+ */
+static inline int dtmf_core_ac_size(const struct dtmf_pattern *patterns, unsigned int count)
+{
+   unsigned int i, j, states = 1;
+
+   if (count > DTMF_PATTERN_MAX) return -1;
+   for (i = 0; i < count; i++) {
+      if (!patterns[i].len || patterns[i].len > DTMF_SEQ_MAX) return -1;
+      for (j = 0; j < patterns[i].len; j++)
+         if (dtmf_core_nibble(patterns[i].keys[j]) < 0) return -1;
+      states += patterns[i].len;
+   }
+   return states;
+}
+
+/** @brief Compiles a set of patterns checked by dtmf_core_ac_size() into a matcher
+ *  The first of two equal patterns wins.
+ *  @param states receives the states, as many as dtmf_core_ac_size() returned
+ *  @param scratch room for twice that many __u16 -- the queue and the failure links
+ *  @return the number of states used
+ */
+static inline unsigned int dtmf_core_ac_build(struct dtmf_core_ac_state *states, const struct dtmf_pattern *patterns,
+                                              unsigned int count, __u16 *scratch)
+{
+   unsigned int i, j, c, n = 1, head = 0, tail = 0;
+   __u16 s, t, f, *queue, *fail;
+
+   memset(&states[0], 0, sizeof(states[0]));
+   states[0].pattern = -1;
+   for (i = 0; i < count; i++) {               // The trie, 0 means no child yet
+      s = 0;
+      for (j = 0; j < patterns[i].len; j++) {
+         c = dtmf_core_nibble(patterns[i].keys[j]);
+         if (!states[s].next[c]) {
+            memset(&states[n], 0, sizeof(states[n]));
+            states[n].pattern = -1;
+            states[s].next[c] = n++;
+         }
+         s = states[s].next[c];
+      }
+      if (states[s].pattern < 0) states[s].pattern = i;
+   }
+   queue = scratch;
+   fail = scratch + n;
+   for (c = 0; c < 16; c++)                    // The missing children of the start state lead back to it
+      if ((t = states[0].next[c])) {
+         fail[t] = 0;
+         queue[tail++] = t;
+      }
+   while (head < tail) {                        // Breadth first, so the failure state is always done
+      s = queue[head++];
+      for (c = 0; c < 16; c++) {
+         t = states[s].next[c];
+         f = states[fail[s]].next[c];
+         if (t) {
+            fail[t] = f;
+            states[t].dict = states[f].pattern >= 0 ? f : states[f].dict;
+            queue[tail++] = t;
+         }
+         else
+            states[s].next[c] = f;
+      }
+   }
+   return n;
+}
+
+/** @brief Advances the pattern matcher by one key
+ *  @return the new state -- it completes states[state].pattern if that is not -1, and then every
+ *  pattern found by following dict
+ */
+static inline __u16 dtmf_core_ac_step(const struct dtmf_core_ac_state *states, __u16 state, __u8 nibble)
+{
+   return states[state].next[nibble & 0x0f];
+}
+
+/** @brief The state of the pattern matcher of one receiver */
+struct dtmf_core_match {
+   __u16 state;                  ///< The state after the last key, 0 starts over
+   __u8  nibble;                 ///< The Q4..Q1 code of the last key
+   unsigned int keyCount;        ///< Keys seen, keyTimes[] holds the last DTMF_SEQ_MAX of them
+   __u64 keyTimes[DTMF_SEQ_MAX]; ///< The time of every key, a match is stamped with its first key
+};
+
+/** @brief Advances the pattern matcher of a receiver by one key
+ *  @param states the matcher built by dtmf_core_ac_build()
+ *  @param ts_ns the time of the key
+ *  @return the first state that completes a pattern, 0 for none -- the patterns that end at this
+ *  key are those of the state and of every state found from it by following dict
+ */
+static inline __u16 dtmf_core_match_key(struct dtmf_core_match *match, const struct dtmf_core_ac_state *states,
+                                        __u64 ts_ns, __u8 nibble)
+{
+   __u16 state;
+
+   match->keyTimes[match->keyCount++ % DTMF_SEQ_MAX] = ts_ns;
+   match->nibble = nibble;
+   match->state = dtmf_core_ac_step(states, match->state, nibble);
+   state = match->state;
+   return states[state].pattern < 0 ? states[state].dict : state;
+}
+
+/** @brief Fills in the record of a pattern that ended at the last key
+ *  @param len the number of keys of the pattern
+ *  @param id the id the pattern was registered with
+ *  @param out receives the DTMF_EVENT_MATCH record, seq is left to the caller
+ */
+static inline void dtmf_core_match_event(const struct dtmf_core_match *match, __u8 len, __u32 id,
+                                         struct dtmf_event *out)
+{
+   memset(out, 0, sizeof(*out));
+   out->type = DTMF_EVENT_MATCH;
+   out->ts_ns = match->keyTimes[(match->keyCount - len) % DTMF_SEQ_MAX];
+   out->digit = dtmf_core_key(match->nibble);
+   out->nibble = match->nibble;
+   out->len = len;
+   out->match.end_ns = match->keyTimes[(match->keyCount - 1) % DTMF_SEQ_MAX];
+   out->match.id = id;
+}
+
+/** @brief Publishes an event in the mmap()able ring following the protocol of dtmf_rx.h
+ *  The caller must be the only writer.
+ *  @param slots the event slots of the ring
+ *  @param nr_slots the number of slots, a power of 2
+ *  @param event the event, with the seq of the head of the ring
+ */
+static inline void dtmf_core_ring_put(struct dtmf_ring_header *ring, struct dtmf_event *slots, __u32 nr_slots,
+                                      const struct dtmf_event *event)
+{
+   struct dtmf_event *slot = &slots[event->seq & (nr_slots - 1)];
+
+   dtmf_core_store(&slot->seq, event->seq - 1);  // The slot is being written
+   dtmf_core_wmb();
+   slot->ts_ns = event->ts_ns;                   // Everything except seq, field by field for FORTIFY_SOURCE
+   slot->type = event->type;
+   slot->digit = event->digit;
+   slot->nibble = event->nibble;
+   slot->len = event->len;
+   memcpy(slot->digits, event->digits, sizeof(slot->digits));   // The whole union
+   dtmf_core_wmb();
+   dtmf_core_store(&slot->seq, event->seq);      // The slot holds event seq
+   dtmf_core_store_release(&ring->head, event->seq + 1);
+}
+
+/** @brief Fills in the record that tells a reader the events from its cursor on were overwritten
+ *  The reader carries on with the oldest event that is still whole -- the slot of head may be
+ *  being written, so that is the one after it.
+ *  @param head the head of the ring, loaded after the event at cursor was found overwritten
+ *  @param ts_ns when the reader noticed
+ *  @param out receives the DTMF_EVENT_LOST record
+ */
+static inline void dtmf_core_ring_lost(__u32 head, __u32 nr_slots, __u32 cursor, __u64 ts_ns,
+                                       struct dtmf_event *out)
+{
+   memset(out, 0, sizeof(*out));
+   out->ts_ns = ts_ns;
+   out->seq = cursor;
+   out->type = DTMF_EVENT_LOST;
+   out->lost.count = head - nr_slots + 1 - cursor;
+}
+
+/** @brief How far a reader moves its cursor past an event it has read */
+static inline __u32 dtmf_core_ring_skip(const struct dtmf_event *event)
+{
+   return event->type == DTMF_EVENT_LOST ? event->lost.count : 1;
+}
+
+/** @brief A rate measured over fixed windows, e.g. the IRQs of the storm detection */
+struct dtmf_core_rate {
+   __u64 start_ns;               ///< Start of the current window
+   __u32 count;                  ///< Counted in the current window so far
+};
+
+/** @brief Counts n events at ts_ns, starting a new window when the current one is over
+ *  @param window_ns the length of a window
+ *  @return the count of the window that ended, or -1 while the window is still running
+ */
+static inline long dtmf_core_rate_count(struct dtmf_core_rate *rate, __u64 ts_ns, __u64 window_ns, __u32 n)
+{
+   long ended = -1;
+
+   if (ts_ns - rate->start_ns >= window_ns) {
+      ended = rate->count;
+      rate->start_ns = ts_ns;
+      rate->count = 0;
+   }
+   rate->count += n;
+   return ended;
+}
+
+/** @brief Starts a new window at ts_ns */
+static inline void dtmf_core_rate_reset(struct dtmf_core_rate *rate, __u64 ts_ns)
+{
+   rate->start_ns = ts_ns;
+   rate->count = 0;
+}
+
+/** @brief The log2 histogram bucket of a time in ns -- bucket b holds [2^(b-1), 2^b), bucket 0 holds 0
+ *  @param nr_buckets the number of buckets, the last one also holds everything above
+ */
+static inline unsigned int dtmf_core_hist_bucket(__u64 ns, unsigned int nr_buckets)
+{
+#ifdef __KERNEL__
+   unsigned int bucket = fls64(ns);
+#else
+   unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+#endif
+   return bucket < nr_buckets ? bucket : nr_buckets - 1;
+}
+
+#endif /* DTMF_CORE_H */
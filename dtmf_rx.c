@@ -6,228 +6,1675 @@
  * A kernel module for controlling a dtmf receiver chip to read the dtmf data from gpios.
  * It has full support for interrupts and for sysfs entries so that an interface
  * can be created to the inputa signal std and its related data, and that can be configured from Linux userspace.
- * The sysfs entry appears at /sys/dtmf/gpio73
+ * It is a platform driver, so one module can serve many MT88L70 receivers. Each receiver is
+ * described by a device tree/ACPI node (compatible "mitel,mt88l70") or by one entry of the
+ * gpio* module parameter arrays, and gets its own IRQ, event queue and sysfs directory.
+ * The sysfs entry of each receiver appears at /sys/dtmf/gpio73 (named after its StD GPIO)
+ * Every detected tone is also published as a struct dtmf_event (see dtmf_rx.h) in a ring that every
+ * open file of the character device /dev/dtmfN reads through its own cursor, with blocking,
+ * non-blocking or poll()/epoll access, or picks up without any system call by mmap()ing the ring.
+ * In sequence mode the digits of a dialed string are collected and queued as one event.
+ * Log2 histograms of the IRQ and wake up latencies, the inter-digit interval and the tone duration
+ * are kept for every receiver in /sys/kernel/debug/dtmf_rx/dtmfN.
+ * During an IRQ storm the StD IRQ of a receiver is disabled and StD is polled at a bounded rate.
+ * Every receiver is also an input device that reports the keys as KEY_NUMERIC_* presses, held
+ * down for as long as the tone lasts, so that evdev consumers work without the dtmf_event protocol.
+ * A set of key patterns can be registered with an ioctl(), and then only the patterns that were
+ * dialed are queued, so that the consumers are not woken up for the keys that do not matter.
  * REFERENCES: http://www.derekmolloy.ie/
 */
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/gpio.h>       // Required for the GPIO functions
+#include <linux/gpio/consumer.h> // Descriptor based access to sample Q1..Q4 as one array
 #include <linux/interrupt.h>  // Required for the IRQ code
+#include <linux/timekeeping.h> // ktime_get_mono_fast_ns() for the hard IRQ half
 #include <linux/kobject.h>    // Using kobjects for the sysfs bindings
-#include <linux/time.h>       // Using the clock to measure time between button presses
-#define  DEBOUNCE_TIME 20    ///< The default bounce time -- 20ms
+#include <linux/time.h>       // NSEC_PER_SEC for printing the time between button presses
+#include <linux/ktime.h>      // Monotonic timestamps for the queued events
+#include <linux/fs.h>         // Required for the file operations of the character device
+#include <linux/miscdevice.h> // The /dev/dtmfN character devices are misc devices
+#include <linux/kfifo.h>      // Hands the captured tones from the hard IRQ half to the thread
+#include <linux/wait.h>       // Blocking readers sleep on a wait queue
+#include <linux/poll.h>       // Required for poll()/epoll support
+#include <linux/mutex.h>      // Serialises concurrent readers of one open file
+#include <linux/uaccess.h>    // Required for copying the events to userspace
+#include <linux/platform_device.h> // Every receiver is a platform device
+#include <linux/mod_devicetable.h> // Device tree match table
+#include <linux/idr.h>        // Allocates the N of /dev/dtmfN
+#include <linux/slab.h>       // Required for the devm_* allocations
+#include <linux/vmalloc.h>    // The mmap()able event ring is vmalloc()ed
+#include <linux/mm.h>         // Required for mapping the ring into userspace
+#include <linux/hrtimer.h>    // The glitch filter and the timeouts of sequence mode
+#include <linux/spinlock.h>   // Serialises the IRQ thread and the sequence timer as event producers
+#include <linux/percpu.h>     // Lockless per-CPU statistics
+#include <linux/math64.h>     // 64 bit divisions that also link on 32 bit ARM
+#include <linux/debugfs.h>    // The latency and tone timing histograms
+#include <linux/seq_file.h>   // Required for printing the histograms
+#include <linux/input.h>      // Every receiver is also a keypad input device
+#include <linux/rcupdate.h>   // The IRQ thread reads the pattern matcher under RCU
+#include <linux/kref.h>       // Open files keep the receiver context alive after it is unbound
+#include "dtmf_rx.h"          // The struct dtmf_event record shared with userspace
+#include "dtmf_core.h"        // The decode and event state machines, shared with the userspace tests
+#define  CREATE_TRACE_POINTS
+#include "dtmf_rx_trace.h"    // Tracepoints along the capture -> decode -> deliver path
+#define  DEBOUNCE_TIME 2000  ///< The default glitch filter window -- 2ms in us
+#define  CAPTURE_FIFO_SIZE 16 ///< Number of tones latched by the hard IRQ half (must be a power of 2)
+#define  DATA_LINES 4        ///< Q1..Q4, the data outputs of the MT88L70
+#define  RING_BYTES PAGE_SIZE ///< Size of the event slots of the mmap()able ring
+#define  RING_SLOTS (RING_BYTES / sizeof(struct dtmf_event))  ///< A power of 2 as both sizes are
+#define  SEQ_TIMEOUT 3000000  ///< The default inter-digit timeout of sequence mode -- 3s in us
+#define  STORM_THRESHOLD 2000  ///< The default IRQ rate per second that switches to polling mode
+#define  STORM_WINDOWS 10     ///< The IRQ rate is measured over windows of 1/10 s
+#define  POLL_INTERVAL 1000   ///< The default sampling period of polling mode -- 1ms in us
+#define  HIST_BUCKETS 40     ///< Log2 buckets of a histogram, the last one also holds everything above 2^38 ns
+#define  MAX_LEGACY 16       ///< Maximum number of receivers that can be given as module parameters
+#define  DRIVER_NAME "dtmf-rx"
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("CK Lui");
 MODULE_DESCRIPTION("A Linux character device driver for DTMF Receiver MT88L70 implemented in Beaglebone with accessible outputs in file system.");
 MODULE_VERSION("0.1");
+MODULE_ALIAS("platform:" DRIVER_NAME);
 static bool isRising = 1;                   ///< Rising edge is the default IRQ property
 module_param(isRising, bool, S_IRUGO);      ///< Param desc. S_IRUGO can be read/not changed
 MODULE_PARM_DESC(isRising, " Rising edge = 1 (default), Falling edge = 0");  ///< parameter description
-static unsigned int gpioDTMFdetected = 73;       ///< Default GPIO is 73
-module_param(gpioDTMFdetected, uint, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
+static bool legacy = 1;                     ///< Create receivers from the gpio* parameters below
+module_param(legacy, bool, S_IRUGO);        ///< Param desc. S_IRUGO can be read/not changed
+MODULE_PARM_DESC(legacy, " Create receivers from the gpio* parameters = 1 (default), device tree only = 0");
+static bool useInput = 1;                   ///< Register an input device for every receiver
+module_param(useInput, bool, S_IRUGO);      ///< Param desc. S_IRUGO can be read/not changed
+MODULE_PARM_DESC(useInput, " Report the keys on an input device = 1 (default), /dev/dtmfN only = 0");
+/// The GPIO parameters are arrays -- entry N describes receiver N, e.g. gpioDTMFdetected=73,80
+static unsigned int gpioDTMFdetected[MAX_LEGACY] = { 73 };  ///< Default GPIO is 73
+static int numDetected = 1;                 ///< Number of receivers given as module parameters
+module_param_array(gpioDTMFdetected, uint, &numDetected, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
 MODULE_PARM_DESC(gpioDTMFdetected, " GPIO assigned to DTMFdetected signal (default=73)");  ///< parameter description
-static unsigned int gpioDTMFdata1 = 86;       ///< Default GPIO is 86
-module_param(gpioDTMFdata1, uint, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
+static unsigned int gpioDTMFdata1[MAX_LEGACY] = { 86 };     ///< Default GPIO is 86
+static int numData1 = 1;
+module_param_array(gpioDTMFdata1, uint, &numData1, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
 MODULE_PARM_DESC(gpioDTMFdata1, " GPIO assigned to DTMFdata1 signal (default=86)");  ///< parameter description
-static unsigned int gpioDTMFdata2 = 75;       ///< Default GPIO is 75
-module_param(gpioDTMFdata2, uint, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
+static unsigned int gpioDTMFdata2[MAX_LEGACY] = { 75 };     ///< Default GPIO is 75
+static int numData2 = 1;
+module_param_array(gpioDTMFdata2, uint, &numData2, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
 MODULE_PARM_DESC(gpioDTMFdata2, " GPIO assigned to DTMFdata2 signal (default=75)");  ///< parameter description
-static unsigned int gpioDTMFdata3 = 76;       ///< Default GPIO is 76
-module_param(gpioDTMFdata3, uint, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
+static unsigned int gpioDTMFdata3[MAX_LEGACY] = { 76 };     ///< Default GPIO is 76
+static int numData3 = 1;
+module_param_array(gpioDTMFdata3, uint, &numData3, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
 MODULE_PARM_DESC(gpioDTMFdata3, " GPIO assigned to DTMFdata3 signal (default=76)");  ///< parameter description
-static unsigned int gpioDTMFdata4 = 77;       ///< Default GPIO is 77
-module_param(gpioDTMFdata4, uint, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
+static unsigned int gpioDTMFdata4[MAX_LEGACY] = { 77 };     ///< Default GPIO is 77
+static int numData4 = 1;
+module_param_array(gpioDTMFdata4, uint, &numData4, S_IRUGO);    ///< Param desc. S_IRUGO can be read/not changed
 MODULE_PARM_DESC(gpioDTMFdata4, " GPIO assigned to DTMFdata4 signal (default=77)");  ///< parameter description
-static unsigned int gpioDTMFpd = 87;           ///< Default GPIO is 87
-module_param(gpioDTMFpd, uint, S_IRUGO);       ///< Param desc. S_IRUGO can be read/not changed
-MODULE_PARM_DESC(gpioDTMFpd, " GPIO assigned to DTMFpd signal (default=87)");         ///< parameter description
+static unsigned int gpioDTMFpd[MAX_LEGACY] = { 87 };        ///< Default GPIO is 87
+static int numPd = 1;
+module_param_array(gpioDTMFpd, uint, &numPd, S_IRUGO);       ///< Param desc. S_IRUGO can be read/not changed
+MODULE_PARM_DESC(gpioDTMFpd, " GPIO assigned to DTMFpd signal (default=87, optional)");         ///< parameter description
 //DTMF detected indicator @ gpio51
-static unsigned int gpioLED = 51;           ///< Default GPIO is 51
-module_param(gpioLED, uint, S_IRUGO);       ///< Param desc. S_IRUGO can be read/not changed
-MODULE_PARM_DESC(gpioLED, " GPIO LED number (default=51)");         ///< parameter description
-
- static char   gpioName[8] = "gpioXXX";      ///< Null terminated default string -- just in case
-static int    irqNumber;                    ///< Used to share the IRQ number within this file
-static int    numberPresses = 0;            ///< For information, store the number of button presses
-static bool   DTMFdetected = 0;                 ///< Use to store DTMFdetected (off by default)
-static unsigned int   DTMFdata1 = 0;                    ///< Use to store data 1 (0 by default)
-static unsigned int  DTMFdata2 = 0;                    ///< Use to store data 2 (0 by default)
-static  unsigned int   DTMFdata3 = 0;                    ///< Use to store data 3 (0 by default)
-static unsigned int   DTMFdata4 = 0;                    ///< Use to store data 4 (0 by default)
-static unsigned int   DTMFdigit = 0;                    ///< Use to store dtmf digit recieved (0 by default)
-static int *digit=0;                    ///< Use to store digit received (0 by default)
-static bool   isDebounce = 1;               ///< Use to store the debounce state (on by default)
-static bool   isDTMFpd = 0;               ///< Use to store the DTMFpd state (off by default)
-static bool     ledOn = 0;          ///< Use to show dtmf detected status (off by default)
-static struct timespec ts_last, ts_current, ts_diff;  ///< timespecs from linux/time.h (has nano precision)
-
-/// Function prototype for the custom IRQ handler function -- see below for the implementation
-static irq_handler_t  dtmfrx_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
+static unsigned int gpioLED[MAX_LEGACY] = { 51 };           ///< Default GPIO is 51
+static int numLED = 1;
+module_param_array(gpioLED, uint, &numLED, S_IRUGO);       ///< Param desc. S_IRUGO can be read/not changed
+MODULE_PARM_DESC(gpioLED, " GPIO LED number (default=51, optional)");         ///< parameter description
+
+/** @brief The GPIOs of a receiver that was given as module parameters */
+struct dtmfrx_platform_data {
+   unsigned int gpioDTMFdetected;           ///< StD
+   unsigned int gpioDTMFdata[DATA_LINES];   ///< Q1..Q4
+   int gpioDTMFpd;                          ///< PD, -1 if not connected
+   int gpioLED;                             ///< DTMF detected indicator, -1 if not connected
+};
+
+/** @brief An StD edge latched by the hard IRQ half, waiting for the threaded half */
+struct dtmfrx_capture {
+   u64 ts_ns;                               ///< Monotonic timestamp of the StD edge
+   u64 latch_ns;                            ///< When it was latched, after the glitch filter if it is on
+   u8  level;                               ///< The StD level after the edge, 1 for a rising edge
+   bool decode;                             ///< The edge selected by isRising, nibble holds the tone
+   u8  nibble;                              ///< Q4..Q1 sampled at the StD edge
+};
+
+/// The histograms in debugfs, indexes of dtmfrx_pcpu_stats.hist[]
+enum {
+   HIST_IRQ_LATENCY,                        ///< Latch in the hard half or a timer to the threaded half
+   HIST_WAKE_LATENCY,                       ///< Wake up by the threaded half to the reader running
+   HIST_DIGIT_INTERVAL,                     ///< Between the decode edges of two tones
+   HIST_TONE_DURATION,                      ///< StD rising to falling edge
+   HIST_NR
+};
+
+/** @brief The counters of one receiver on one CPU -- this_cpu_inc() needs no lock, even from the hard IRQ.
+ *  They are u64 like struct dtmf_stats, so they do not wrap on 32-bit ARM either.
+ */
+struct dtmfrx_pcpu_stats {
+   u64    keys[16];                         ///< Per key histogram, indexed by the Q4..Q1 code
+   u64    stat[DTMF_STAT_NR];               ///< The DTMF_STAT_* counters
+   u64    hist[HIST_NR][HIST_BUCKETS];      ///< Bucket b counts the times in [2^(b-1), 2^b) ns
+};
+
+/** @brief The private data of one histogram file in debugfs */
+struct dtmfrx_hist_file {
+   struct dtmfrx_dev *dtmf;                 ///< The receiver
+   int    index;                            ///< The HIST_* histogram shown
+};
+
+/** @brief The compiled patterns of a receiver, replaced as a whole by DTMF_IOC_SET_PATTERNS */
+struct dtmfrx_matcher {
+   struct rcu_head rcu;                     ///< Freed once the IRQ thread can no longer be using it
+   u32    gen;                              ///< Tells the IRQ thread that its matcher state is stale
+   u32    ids[DTMF_PATTERN_MAX];            ///< The id of every pattern
+   u8     lens[DTMF_PATTERN_MAX];           ///< The number of keys of every pattern
+   struct dtmf_core_ac_state states[];      ///< The automaton, see dtmf_core.h
+};
+
+/** @brief The per-receiver context -- nothing in the IRQ or read paths is shared between receivers
+ *  It is not devm memory: the open files of /dev/dtmfN still use it after the receiver is unbound,
+ *  so it is freed with the ring, the counters and the patterns by the last dtmfrx_put().
+ */
+struct dtmfrx_dev {
+   struct kref ref;                         ///< Held by the bound receiver and by every open file
+   bool   isDead;                           ///< The receiver was unbound, the open files get -ENODEV
+   struct device *dev;                      ///< The platform device of this receiver
+   struct gpio_desc *std;                   ///< StD, the DTMF detected input
+   struct gpio_descs *data;                 ///< Q1..Q4, Q1 is bit 0 of the nibble
+   struct gpio_desc *pd;                    ///< PD output (optional)
+   struct gpio_desc *led;                   ///< DTMF detected indicator (optional)
+   int    irqNumber;                        ///< The IRQ of the StD line
+   int    id;                               ///< The N of /dev/dtmfN
+   char   gpioName[16];                     ///< Name of the link in /sys/dtmf, e.g. gpio73
+   struct miscdevice miscdev;               ///< /dev/dtmfN
+   unsigned int DTMFdigit;                  ///< The last Q4..Q1 code received
+   int    digit;                            ///< The ASCII key of the digit received
+   unsigned int debounceTime;               ///< Window of the glitch filter in us, 0 turns it off
+   bool   isDTMFpd;                         ///< Use to store the DTMFpd state (off by default)
+   bool   ledOn;                            ///< Use to show dtmf detected status (off by default)
+   u64    ts_last_ns;                       ///< Monotonic timestamp of the last tone in ns
+   u64    ts_diff_ns;                       ///< The time between the last two tones in ns
+   u64    rise_ns;                          ///< Monotonic timestamp of the last StD rising edge, 0 once it fell
+   u8     stdLevel;                         ///< The StD level of the last edge latched, protected by capture_lock
+   u64    edge_ns;                          ///< First StD edge waiting for the glitch filter, 0 for none
+   int    edge_nibble;                      ///< Q4..Q1 sampled at the last StD edge by the glitch filter, -1 for none
+   struct hrtimer debounce_timer;           ///< The glitch filter, fires once StD has been stable for debounceTime
+   unsigned int stormThreshold;             ///< IRQs per second that switch to polling mode, 0 for never
+   unsigned int pollInterval;               ///< Sampling period of polling mode in us
+   bool   isPolling;                        ///< The IRQ is disabled and StD is sampled by poll_timer
+   bool   isStopping;                       ///< The receiver is going away, polling mode must not start again
+   struct dtmf_core_rate storm;             ///< IRQs, or StD changes seen by polling, in the current window
+   u8     poll_level;                       ///< The previous StD sample of polling mode
+   struct hrtimer poll_timer;               ///< Samples StD in polling mode
+   /// Serialises the producers of capture_fifo -- the hard IRQ half, debounce_timer and poll_timer --
+   /// and the switches between interrupt and polling mode. A raw lock, and both timers expire in
+   /// hard interrupt context, so that none of them sleeps on PREEMPT_RT
+   raw_spinlock_t capture_lock;
+   atomic64_t wake_ns;                      ///< When sleeping readers were last woken up, 0 once one ran
+   u64    irqMaxTime;                       ///< Worst-case time spent in the hard IRQ handler in ns
+   u32    eventSeq;                         ///< Sequence number given to the next queued event
+   struct dtmfrx_pcpu_stats __percpu *stats;  ///< The counters, summed over all CPUs when read
+   struct dtmf_stats stats_base;            ///< The counters at the last reset, protected by stats_lock
+   u64    hist_base[HIST_NR][HIST_BUCKETS]; ///< The histograms at the last reset, protected by stats_lock
+   struct mutex stats_lock;                 ///< Serialises reading and resetting the counters
+   bool   isSequence;                       ///< Collect digits into sequences (off by default)
+   unsigned int seqTimeout;                 ///< Inter-digit timeout of sequence mode in us
+   unsigned int seqMaxTime;                 ///< Completion timeout from the first key in us, 0 for none
+   char   seqTerminator;                    ///< Key that completes a sequence at once, 0 for none
+   struct dtmf_core_seq sequence;           ///< The sequence being collected, protected by emit_lock
+   struct hrtimer seq_timer;                ///< Fires when the sequence being collected times out
+   /// Serialises the producers of events -- the IRQ thread and seq_timer -- and protects readers.
+   /// read() never takes it, it follows the seqlock protocol of the ring
+   spinlock_t emit_lock;
+   struct list_head readers;                ///< The open files, for the queue depth of the dtmfrx_enqueue tracepoint
+   /// Hard IRQ half or glitch filter -> threaded half. The producers hold capture_lock
+   DECLARE_KFIFO(capture_fifo, struct dtmfrx_capture, CAPTURE_FIFO_SIZE);
+   wait_queue_head_t wait;                  ///< Readers wait here for the next event
+   struct dtmf_ring_header *ring;           ///< The mmap()able ring -- one header page, then the slots
+   struct dtmf_event *ring_slots;           ///< The RING_SLOTS event slots of the ring
+   struct dentry *debugfs;                  ///< /sys/kernel/debug/dtmf_rx/dtmfN
+   struct input_dev *input;                 ///< The keypad input device, NULL if useInput is off
+   unsigned short keycodes[16];             ///< The keymap of the input device, indexed by the Q4..Q1 code
+   unsigned int inputCode;                  ///< The key held down on the input device, KEY_RESERVED for none
+   struct dtmfrx_hist_file histFiles[HIST_NR];  ///< The private data of the histogram files
+   struct dtmfrx_matcher __rcu *matcher;    ///< The patterns, NULL if none are registered
+   struct mutex match_lock;                 ///< Serialises the replacement of the patterns
+   u32    matchGen;                         ///< The gen of the last matcher, protected by match_lock
+   /// The state of the matcher and the gen of the matcher it belongs to, only used by the IRQ thread
+   u32    matchStateGen;
+   struct dtmf_core_match match;
+};
+
+/** @brief The state of one open file of /dev/dtmfN -- f_pos is its cursor, the seq of the next event */
+struct dtmfrx_reader {
+   struct dtmfrx_dev *dtmf;                 ///< The receiver that was opened
+   struct file *file;                       ///< The open file, f_pos is read by dtmfrx_depth()
+   struct list_head node;                   ///< In dtmf->readers, protected by emit_lock
+   struct mutex lock;                       ///< Serialises read() and lseek() on this file
+};
+
+/** @brief The default keymap of the input device, indexed by the Q4..Q1 code like dtmf_core_keys */
+static const unsigned short dtmfrx_keycodes[16] = {
+   KEY_NUMERIC_D, KEY_NUMERIC_1, KEY_NUMERIC_2, KEY_NUMERIC_3, KEY_NUMERIC_4, KEY_NUMERIC_5,
+   KEY_NUMERIC_6, KEY_NUMERIC_7, KEY_NUMERIC_8, KEY_NUMERIC_9, KEY_NUMERIC_0, KEY_NUMERIC_STAR,
+   KEY_NUMERIC_POUND, KEY_NUMERIC_A, KEY_NUMERIC_B, KEY_NUMERIC_C
+};
+
+static struct kobject *dtmfrx_kobj;         ///< /sys/dtmf, holds a link to every receiver
+static DEFINE_IDA(dtmfrx_ida);              ///< Allocates the N of /dev/dtmfN
+static struct platform_device *legacyDevs[MAX_LEGACY];  ///< Receivers created from module parameters
+static struct dentry *dtmfrx_debugfs;       ///< /sys/kernel/debug/dtmf_rx, holds a directory for every receiver
+
+/// Function prototypes for the two halves of the IRQ handler -- see below for the implementation
+static irqreturn_t dtmfrx_irq_handler(int irq, void *dev_id);
+static irqreturn_t dtmfrx_irq_thread(int irq, void *dev_id);
+
+/** @brief Adds one to a counter of the receiver, safe from any context */
+#define dtmfrx_stat_inc(dtmf, index) this_cpu_inc((dtmf)->stats->stat[index])
+
+/** @brief Adds a time in ns to a histogram of the receiver, safe from any context */
+static void dtmfrx_hist_add(struct dtmfrx_dev *dtmf, int index, u64 ns){
+   if((s64)ns < 0) ns = 0;                    // The two timestamps were taken on different CPUs
+   this_cpu_inc(dtmf->stats->hist[index][dtmf_core_hist_bucket(ns, HIST_BUCKETS)]);
+}
+
+/** @brief Sums one histogram of a receiver over all CPUs -- must be called with stats_lock held
+ *  @param hist receives the HIST_BUCKETS counts since the last reset
+ */
+static void dtmfrx_hist_read(struct dtmfrx_dev *dtmf, int index, u64 *hist){
+   int cpu, i;
+
+   lockdep_assert_held(&dtmf->stats_lock);
+   for(i = 0; i < HIST_BUCKETS; i++) hist[i] = -dtmf->hist_base[index][i];
+   for_each_possible_cpu(cpu)
+      for(i = 0; i < HIST_BUCKETS; i++) hist[i] += READ_ONCE(per_cpu_ptr(dtmf->stats, cpu)->hist[index][i]);
+}
+
+/** @brief Sums the counters of a receiver over all CPUs -- must be called with stats_lock held
+ *  @param stats receives the counters since the last reset
+ */
+static void dtmfrx_stats_read(struct dtmfrx_dev *dtmf, struct dtmf_stats *stats){
+   const struct dtmfrx_pcpu_stats *pcpu;
+   int cpu, i;
+
+   lockdep_assert_held(&dtmf->stats_lock);
+   memset(stats, 0, sizeof(*stats));
+   for_each_possible_cpu(cpu){
+      pcpu = per_cpu_ptr(dtmf->stats, cpu);
+      for(i = 0; i < 16; i++) stats->keys[i] += READ_ONCE(pcpu->keys[i]);
+      for(i = 0; i < DTMF_STAT_NR; i++) stats->stat[i] += READ_ONCE(pcpu->stat[i]);
+   }
+   for(i = 0; i < 16; i++) stats->keys[i] -= dtmf->stats_base.keys[i];
+   for(i = 0; i < DTMF_STAT_NR; i++) stats->stat[i] -= dtmf->stats_base.stat[i];
+   stats->version = DTMF_STATS_VERSION;
+   stats->nr_stats = DTMF_STAT_NR;
+}
+
+/** @brief Resets the counters of a receiver -- the per-CPU counters keep running, the current
+ *  totals just become the new base, so a concurrent increment is never lost.
+ */
+static void dtmfrx_stats_reset(struct dtmfrx_dev *dtmf){
+   struct dtmf_stats now;
+   u64 hist[HIST_BUCKETS];
+   int i, j;
+
+   mutex_lock(&dtmf->stats_lock);
+   dtmfrx_stats_read(dtmf, &now);
+   for(i = 0; i < 16; i++) dtmf->stats_base.keys[i] += now.keys[i];
+   for(i = 0; i < DTMF_STAT_NR; i++) dtmf->stats_base.stat[i] += now.stat[i];
+   for(i = 0; i < HIST_NR; i++){                 // The histograms start over as well
+      dtmfrx_hist_read(dtmf, i, hist);
+      for(j = 0; j < HIST_BUCKETS; j++) dtmf->hist_base[i][j] += hist[j];
+   }
+   mutex_unlock(&dtmf->stats_lock);
+}
+
+/** @brief Reads one counter of a receiver since the last reset */
+static u64 dtmfrx_stat_get(struct dtmfrx_dev *dtmf, int index){
+   struct dtmf_stats stats;
+
+   mutex_lock(&dtmf->stats_lock);
+   dtmfrx_stats_read(dtmf, &stats);
+   mutex_unlock(&dtmf->stats_lock);
+   return stats.stat[index];
+}
 
 /** @brief A callback function to output the numberPresses variable
- *  @param kobj represents a kernel object device that appears in the sysfs filesystem
- *  @param attr the pointer to the kobj_attribute struct
+ *  @param dev the receiver device that appears in the sysfs filesystem
+ *  @param attr the pointer to the device_attribute struct
  *  @param buf the buffer to which to write the number of presses
  *  @return return the total number of characters written to the buffer (excluding null)
  */
-static ssize_t numberPresses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", numberPresses);
+static ssize_t numberPresses_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%llu\n", dtmfrx_stat_get(dtmf, DTMF_STAT_DIGITS));
 }
 
 /** @brief A callback function to read in the numberPresses variable
- *  @param kobj represents a kernel object device that appears in the sysfs filesystem
- *  @param attr the pointer to the kobj_attribute struct
+ *  @param dev the receiver device that appears in the sysfs filesystem
+ *  @param attr the pointer to the device_attribute struct
  *  @param buf the buffer from which to read the number of presses (e.g., reset to 0).
  *  @param count the number characters in the buffer
  *  @return return should return the total number of characters used from the buffer
  */
-static ssize_t numberPresses_store(struct kobject *kobj, struct kobj_attribute *attr,
+static ssize_t numberPresses_store(struct device *dev, struct device_attribute *attr,
                                    const char *buf, size_t count){
-   sscanf(buf, "%du", &numberPresses);
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   struct dtmf_stats stats;
+   u64 temp;
+
+   if(kstrtou64(buf, 0, &temp)) return -EINVAL;
+   mutex_lock(&dtmf->stats_lock);                // Move the base so that the count reads back as temp
+   dtmfrx_stats_read(dtmf, &stats);
+   dtmf->stats_base.stat[DTMF_STAT_DIGITS] += stats.stat[DTMF_STAT_DIGITS] - temp;
+   mutex_unlock(&dtmf->stats_lock);
    return count;
 }
 
 /** @Displays if the LED is on or off */
-static ssize_t ledOn_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", ledOn);
+static ssize_t ledOn_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", dtmf->ledOn);
 }
 
-/** @Displays DTMFdetetced */
-static ssize_t DTMFdetected_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", DTMFdetected);
+/** @Displays DTMFdetetced -- the current level of the StD line */
+static ssize_t DTMFdetected_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", gpiod_get_value_cansleep(dtmf->std));
 }
 
+/** @Displays DTMFdata1..4 -- the bits of the last code received, shared by the four attributes */
+static ssize_t dtmfrx_data_show(struct device *dev, char *buf, int bit){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", (dtmf->DTMFdigit >> bit) & 1);
+}
 /** @Displays DTMFdata1*/
-static ssize_t DTMFdata1_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", DTMFdata1);
+static ssize_t DTMFdata1_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return dtmfrx_data_show(dev, buf, 0);
 }
  /** @Displays DTMFdata2*/
-static ssize_t DTMFdata2_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", DTMFdata2);
+static ssize_t DTMFdata2_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return dtmfrx_data_show(dev, buf, 1);
 }
 /** @Displays DTMFdata3*/
-static ssize_t DTMFdata3_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", DTMFdata3);
+static ssize_t DTMFdata3_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return dtmfrx_data_show(dev, buf, 2);
 }
 /** @Displays DTMFdata4*/
-static ssize_t DTMFdata4_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", DTMFdata4);
+static ssize_t DTMFdata4_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return dtmfrx_data_show(dev, buf, 3);
 }
 
 /** @Displays if DTMFpd is on or off */
-static ssize_t isDTMFpd_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", isDTMFpd);
+static ssize_t isDTMFpd_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", dtmf->isDTMFpd);
 }
-/** @brief Stores and sets the debounce state */
-static ssize_t isDTMFpd_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
-   unsigned int temp;
-   sscanf(buf, "%du", &temp);                // use a temp varable for correct int->bool
-   gpio_set_value(gpioDTMFpd,0);
-   isDTMFpd = temp;
-   if(isDTMFpd) { gpio_set_value(gpioDTMFpd, isDTMFpd);
-      printk(KERN_INFO "gpioDTMFpd: DTMFpd is set \n");
-   }
-   else { gpio_set_debounce(gpioDTMFpd, 0);  // set the debounce time to 0
-      printk(KERN_INFO "gpioDTMFdetetced: Debounce off\n");
-   }
+/** @brief Stores and sets the power down state */
+static ssize_t isDTMFpd_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   bool temp;
+   if(!dtmf->pd) return -ENODEV;             // PD is not connected on this receiver
+   if(kstrtobool(buf, &temp)) return -EINVAL;
+   dtmf->isDTMFpd = temp;
+   gpiod_set_value_cansleep(dtmf->pd, dtmf->isDTMFpd);
+   dev_info(dev, "DTMFpd is %s\n", dtmf->isDTMFpd ? "set" : "cleared");
    return count;
 }
 
-/** @brief Displays the last time the button was pressed -- manually output the date (no localization) */
-static ssize_t lastTime_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%.2lu:%.2lu:%.2lu:%.9lu \n", (ts_last.tv_sec/3600)%24,
-          (ts_last.tv_sec/60) % 60, ts_last.tv_sec % 60, ts_last.tv_nsec );
+/** @brief Displays the last time the button was pressed -- manually output the date (no localization)
+ *  The press is stored as a monotonic timestamp, it is turned into the time of day only here.
+ */
+static ssize_t lastTime_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   u64 real = ktime_get_real_ns() - (ktime_get_ns() - READ_ONCE(dtmf->ts_last_ns));
+   u32 nsec, secs;
+
+   div_u64_rem(div_u64_rem(real, NSEC_PER_SEC, &nsec), 24 * 3600, &secs);   // Seconds of the day
+   return sprintf(buf, "%.2u:%.2u:%.2u:%.9u \n", secs / 3600, (secs / 60) % 60, secs % 60, nsec);
 }
 
 /** @brief Display the time difference in the form secs.nanosecs to 9 places */
-static ssize_t diffTime_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%lu.%.9lu\n", ts_diff.tv_sec, ts_diff.tv_nsec);
+static ssize_t diffTime_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   u32 nsec;
+   u64 secs = div_u64_rem(READ_ONCE(dtmf->ts_diff_ns), NSEC_PER_SEC, &nsec);
+   return sprintf(buf, "%llu.%.9u\n", secs, nsec);
 }
 
-/** @brief Displays if button debouncing is on or off */
-static ssize_t isDebounce_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
-   return sprintf(buf, "%d\n", isDebounce);
+/** @brief Displays the number of tones dropped because the IRQ thread fell behind */
+static ssize_t overflows_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%llu\n", dtmfrx_stat_get(dtmf, DTMF_STAT_OVERFLOWS));
 }
-/** @brief Stores and sets the debounce state */
-static ssize_t isDebounce_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+
+/** @brief Displays all the counters in one go, one "name value" pair per line */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf){
+   static const char * const names[DTMF_STAT_NR] = {
+      "tones", "digits", "invalid", "spurious", "overflows", "wakeups", "storms", "polls"
+   };
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   struct dtmf_stats stats;
+   int len = 0, i;
+
+   mutex_lock(&dtmf->stats_lock);
+   dtmfrx_stats_read(dtmf, &stats);
+   mutex_unlock(&dtmf->stats_lock);
+   for(i = 0; i < DTMF_STAT_NR; i++)
+      len += sysfs_emit_at(buf, len, "%s %llu\n", names[i], stats.stat[i]);
+   for(i = 0; i < 16; i++)
+      len += sysfs_emit_at(buf, len, "key%c %llu\n", dtmf_core_key(i), stats.keys[i]);
+   return len;
+}
+/** @brief Resets all the counters (write 0) */
+static ssize_t stats_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
    unsigned int temp;
-   sscanf(buf, "%du", &temp);                // use a temp varable for correct int->bool
-   gpio_set_debounce(gpioDTMFdetected,0);
-   isDebounce = temp;
-   if(isDebounce) { gpio_set_debounce(gpioDTMFdetected, DEBOUNCE_TIME);
-      printk(KERN_INFO "gpioDTMFdetetced: Debounce on\n");
-   }
-   else { gpio_set_debounce(gpioDTMFdetected, 0);  // set the debounce time to 0
-      printk(KERN_INFO "gpioDTMFdetetced: Debounce off\n");
-   }
+   if(kstrtouint(buf, 0, &temp) || temp) return -EINVAL;
+   dtmfrx_stats_reset(dtmf);
    return count;
 }
-/**  Use these helper macros to define the name and access levels of the kobj_attributes
- *  The kobj_attribute has an attribute attr (name and mode), show and store function pointers
- *  The count variable is associated with the numberPresses variable and it is to be exposed
- *  with mode 0660 using the numberPresses_show and numberPresses_store functions above
+
+/** @brief Displays the worst-case time in ns spent in the hard IRQ handler with interrupts masked */
+static ssize_t irqMaxTime_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%llu\n", READ_ONCE(dtmf->irqMaxTime));
+}
+/** @brief Resets the worst-case hard IRQ time (e.g., write 0) */
+static ssize_t irqMaxTime_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   u64 temp;
+   if(kstrtou64(buf, 0, &temp)) return -EINVAL;
+   WRITE_ONCE(dtmf->irqMaxTime, temp);
+   return count;
+}
+
+/** @brief Displays the window of the glitch filter in us (0 means off) */
+static ssize_t debounceTime_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%u\n", dtmf->debounceTime);
+}
+/** @brief Stores the window of the glitch filter in us, it applies from the next StD edge
+ *  StD must be stable for this long before an edge is latched, a shorter pulse is a glitch.
  */
-static struct kobj_attribute count_attr = __ATTR(numberPresses, 0660, numberPresses_show, numberPresses_store);
-static struct kobj_attribute debounce_attr = __ATTR(isDebounce, 0660, isDebounce_show, isDebounce_store);
-static struct kobj_attribute DTMFpd_attr = __ATTR(isDTMFpd, 0660, isDTMFpd_show, isDTMFpd_store);
+static ssize_t debounceTime_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   unsigned int temp;
+   if(kstrtouint(buf, 0, &temp) || temp > USEC_PER_SEC) return -EINVAL;
+   WRITE_ONCE(dtmf->debounceTime, temp);
+   dev_info(dev, "Debounce %uus\n", temp);
+   return count;
+}
 
+/** @brief Displays the IRQ rate per second that switches to polling mode (0 means never) */
+static ssize_t stormThreshold_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%u\n", dtmf->stormThreshold);
+}
+/** @brief Stores the IRQ rate per second that switches to polling mode, 0 turns polling mode off */
+static ssize_t stormThreshold_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   unsigned int temp;
+   if(kstrtouint(buf, 0, &temp)) return -EINVAL;
+   WRITE_ONCE(dtmf->stormThreshold, temp);
+   return count;
+}
+
+/** @brief Displays the sampling period of polling mode in us */
+static ssize_t pollInterval_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%u\n", dtmf->pollInterval);
+}
+/** @brief Stores the sampling period of polling mode in us, at least 100us to bound the CPU cost */
+static ssize_t pollInterval_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   unsigned int temp;
+   if(kstrtouint(buf, 0, &temp) || temp < 100 || temp > USEC_PER_SEC) return -EINVAL;
+   WRITE_ONCE(dtmf->pollInterval, temp);
+   return count;
+}
+
+/** @brief Displays if the receiver is in polling mode because of an IRQ storm */
+static ssize_t isPolling_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", READ_ONCE(dtmf->isPolling));
+}
+static void dtmfrx_seq_flush(struct dtmfrx_dev *dtmf, char terminator);
+static void dtmfrx_wake(struct dtmfrx_dev *dtmf);
+
+/** @brief Displays if sequence mode is on or off */
+static ssize_t isSequence_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", dtmf->isSequence);
+}
+/** @brief Stores the sequence mode -- a sequence that is being collected is queued when it is turned off */
+static ssize_t isSequence_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   unsigned long flags;
+   bool temp;
 
-/**  The __ATTR_RO macro defines a read-only attribute. There is no need to identify that the
- *  function is called _show, but it must be present. __ATTR_WO can be  used for a write-only
- *  attribute but only in Linux 3.11.x on.
+   if(kstrtobool(buf, &temp)) return -EINVAL;
+   spin_lock_irqsave(&dtmf->emit_lock, flags);
+   dtmf->isSequence = temp;
+   if(!temp) dtmfrx_seq_flush(dtmf, 0);
+   spin_unlock_irqrestore(&dtmf->emit_lock, flags);
+   if(!temp){
+      hrtimer_cancel(&dtmf->seq_timer);
+      dtmfrx_wake(dtmf);
+   }
+   return count;
+}
+
+/** @brief Displays the inter-digit timeout of sequence mode in us */
+static ssize_t seqTimeout_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%u\n", dtmf->seqTimeout);
+}
+/** @brief Stores the inter-digit timeout of sequence mode in us, it applies from the next key */
+static ssize_t seqTimeout_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   unsigned int temp;
+   if(kstrtouint(buf, 0, &temp) || !temp) return -EINVAL;
+   WRITE_ONCE(dtmf->seqTimeout, temp);
+   return count;
+}
+
+/** @brief Displays the completion timeout of sequence mode in us (0 means none) */
+static ssize_t seqMaxTime_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   return sprintf(buf, "%u\n", dtmf->seqMaxTime);
+}
+/** @brief Stores the completion timeout of sequence mode in us, it applies from the next key */
+static ssize_t seqMaxTime_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   unsigned int temp;
+   if(kstrtouint(buf, 0, &temp)) return -EINVAL;
+   WRITE_ONCE(dtmf->seqMaxTime, temp);
+   return count;
+}
+
+/** @brief Displays the terminator key of sequence mode (empty if there is none) */
+static ssize_t seqTerminator_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   char terminator = READ_ONCE(dtmf->seqTerminator);
+   return terminator ? sprintf(buf, "%c\n", terminator) : sprintf(buf, "\n");
+}
+/** @brief Stores the terminator key of sequence mode, e.g. "#", or an empty string for none */
+static ssize_t seqTerminator_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct dtmfrx_dev *dtmf = dev_get_drvdata(dev);
+   char terminator = (buf[0] == '\n') ? 0 : buf[0];
+
+   if(terminator && dtmf_core_nibble(terminator) < 0) return -EINVAL;
+   WRITE_ONCE(dtmf->seqTerminator, terminator);
+   return count;
+}
+
+/**  Use these helper macros to define the name and access levels of the device_attributes
+ *  The device_attribute has an attribute attr (name and mode), show and store function pointers
+ *  The numberPresses attribute is associated with the digits counter and it is to be exposed
+ *  with mode 0660 using the numberPresses_show and numberPresses_store functions above
  */
+static DEVICE_ATTR(numberPresses, 0660, numberPresses_show, numberPresses_store);
+static DEVICE_ATTR(debounceTime, 0660, debounceTime_show, debounceTime_store);
+static DEVICE_ATTR(stormThreshold, 0660, stormThreshold_show, stormThreshold_store);
+static DEVICE_ATTR(pollInterval, 0660, pollInterval_show, pollInterval_store);
+static DEVICE_ATTR(isDTMFpd, 0660, isDTMFpd_show, isDTMFpd_store);
+static DEVICE_ATTR(irqMaxTime, 0660, irqMaxTime_show, irqMaxTime_store);
+static DEVICE_ATTR(stats, 0660, stats_show, stats_store);
+static DEVICE_ATTR(isSequence, 0660, isSequence_show, isSequence_store);
+static DEVICE_ATTR(seqTimeout, 0660, seqTimeout_show, seqTimeout_store);
+static DEVICE_ATTR(seqMaxTime, 0660, seqMaxTime_show, seqMaxTime_store);
+static DEVICE_ATTR(seqTerminator, 0660, seqTerminator_show, seqTerminator_store);
 
- static struct kobj_attribute DTMFdetected_attr  = __ATTR_RO(DTMFdetected);  ///< the DTMFdetected kobject attr
-static struct kobj_attribute ledOn_attr = __ATTR_RO(ledOn);     ///< the DTMFpd  kobject attr
-static struct kobj_attribute time_attr  = __ATTR_RO(lastTime);  ///< the last time pressed kobject attr
-static struct kobj_attribute diff_attr  = __ATTR_RO(diffTime);  ///< the difference in time attr
- static struct kobj_attribute DTMFdata1_attr  = __ATTR_RO(DTMFdata1);  ///< the DTMFdata1 kobject attr
-static struct kobj_attribute DTMFdata2_attr  = __ATTR_RO(DTMFdata2);  ///< the DTMFdata2 kobject attr
-static struct kobj_attribute DTMFdata3_attr  = __ATTR_RO(DTMFdata3);  ///< the DTMFdata3 kobject attr
-static struct kobj_attribute DTMFdata4_attr  = __ATTR_RO(DTMFdata4);  ///< the DTMFdata4 kobject attr
+/**  The DEVICE_ATTR_RO macro defines a read-only attribute. There is no need to identify that the
+ *  function is called _show, but it must be present.
+ */
+static DEVICE_ATTR_RO(DTMFdetected);        ///< the DTMFdetected attr
+static DEVICE_ATTR_RO(ledOn);               ///< the LED attr
+static DEVICE_ATTR_RO(lastTime);            ///< the last time pressed attr
+static DEVICE_ATTR_RO(diffTime);            ///< the difference in time attr
+static DEVICE_ATTR_RO(overflows);           ///< the dropped events attr
+static DEVICE_ATTR_RO(isPolling);           ///< the polling mode attr
+static DEVICE_ATTR_RO(DTMFdata1);           ///< the DTMFdata1 attr
+static DEVICE_ATTR_RO(DTMFdata2);           ///< the DTMFdata2 attr
+static DEVICE_ATTR_RO(DTMFdata3);           ///< the DTMFdata3 attr
+static DEVICE_ATTR_RO(DTMFdata4);           ///< the DTMFdata4 attr
 /**  The dtmf_attrs[] is an array of attributes that is used to create the attribute group below.
- *  The attr property of the kobj_attribute is used to extract the attribute struct
+ *  The attr property of the device_attribute is used to extract the attribute struct
  */
 static struct attribute *dtmf_attrs[] = {
-      &count_attr.attr,                  ///< The number of button presses
-      &DTMFpd_attr.attr,                  ///< Is the DTMFpd state true or false
-      &DTMFdetected_attr.attr,                  ///< Is the DTMF detected gpio state true or false
-      &ledOn_attr.attr,                  ///< Is the LED on or off?
-      &time_attr.attr,                   ///< Time of the last button press in HH:MM:SS:NNNNNNNNN
-      &diff_attr.attr,                   ///< The difference in time between the last two presses
-      &debounce_attr.attr,               ///< Is the debounce state true or false
-      &DTMFdata1_attr.attr,               ///< the DTMFdata1
-      &DTMFdata2_attr.attr,               ///< the DTMFdata2
-      &DTMFdata3_attr.attr,               ///< the DTMFdata3
-      &DTMFdata4_attr.attr,               ///< the DTMFdata4
+      &dev_attr_numberPresses.attr,      ///< The number of button presses
+      &dev_attr_isDTMFpd.attr,           ///< Is the DTMFpd state true or false
+      &dev_attr_DTMFdetected.attr,       ///< Is the DTMF detected gpio state true or false
+      &dev_attr_ledOn.attr,              ///< Is the LED on or off?
+      &dev_attr_lastTime.attr,           ///< Time of the last button press in HH:MM:SS:NNNNNNNNN
+      &dev_attr_diffTime.attr,           ///< The difference in time between the last two presses
+      &dev_attr_overflows.attr,          ///< The number of tones dropped because the IRQ thread fell behind
+      &dev_attr_stats.attr,              ///< All the counters in one go
+      &dev_attr_irqMaxTime.attr,         ///< The worst-case time spent in the hard IRQ handler
+      &dev_attr_debounceTime.attr,       ///< The window of the glitch filter in us
+      &dev_attr_stormThreshold.attr,     ///< The IRQ rate that switches to polling mode
+      &dev_attr_pollInterval.attr,       ///< The sampling period of polling mode in us
+      &dev_attr_isPolling.attr,          ///< Is the receiver in polling mode
+      &dev_attr_DTMFdata1.attr,          ///< the DTMFdata1
+      &dev_attr_DTMFdata2.attr,          ///< the DTMFdata2
+      &dev_attr_DTMFdata3.attr,          ///< the DTMFdata3
+      &dev_attr_DTMFdata4.attr,          ///< the DTMFdata4
+      &dev_attr_isSequence.attr,         ///< Is sequence mode on or off
+      &dev_attr_seqTimeout.attr,         ///< The inter-digit timeout of sequence mode in us
+      &dev_attr_seqMaxTime.attr,         ///< The completion timeout of sequence mode in us
+      &dev_attr_seqTerminator.attr,      ///< The key that completes a sequence
       NULL,
 };
+/// The attribute group is created in the directory of every receiver when it is bound to the driver
+ATTRIBUTE_GROUPS(dtmf);
+
+/** @brief Records the wake up latency when a reader runs after it was woken up by dtmfrx_wake() */
+static void dtmfrx_woken(struct dtmfrx_dev *dtmf){
+   u64 woke = atomic64_xchg(&dtmf->wake_ns, 0);   // Only the first reader to run counts
+   if(woke) dtmfrx_hist_add(dtmf, HIST_WAKE_LATENCY, ktime_get_mono_fast_ns() - woke);
+}
+
+/** @brief Copies event seq out of the ring, the driver side of dtmf_ring_read() in dtmf_rx.h
+ *  @return 1 if the event was copied, 0 if it has not been written yet, -1 if it was overwritten
+ */
+static int dtmfrx_ring_get(struct dtmfrx_dev *dtmf, u32 seq, struct dtmf_event *event){
+   const struct dtmf_event *slot = &dtmf->ring_slots[seq & (RING_SLOTS - 1)];
+   u32 before = smp_load_acquire(&slot->seq);
+
+   if(before != seq) return (s32)(before - seq) > 0 ? -1 : 0;
+   memcpy(event, slot, sizeof(*event));
+   smp_rmb();                                    // Pairs with the write barriers of dtmf_core_ring_put()
+   if(READ_ONCE(slot->seq) != seq) return -1;
+   event->seq = seq;
+   return 1;
+}
+
+/** @brief Tells if the ring holds events at or after position pos of a file */
+static bool dtmfrx_pending(struct dtmfrx_dev *dtmf, loff_t pos){
+   return (s32)(smp_load_acquire(&dtmf->ring->head) - (u32)pos) > 0;
+}
+
+/** @brief The read function of /dev/dtmfN
+ *  Copies as many whole struct dtmf_event records as fit in the user buffer, from the cursor of
+ *  this file on. Every open file sees every event, and a slow one never holds up the driver or the
+ *  other files: if its cursor was overwritten it gets one DTMF_EVENT_LOST record and skips to the
+ *  oldest event still in the ring. If there is no new event the caller sleeps until the next one,
+ *  unless the file was opened O_NONBLOCK.
+ *  @param filep the file that is being read
+ *  @param buf the user buffer that receives the events
+ *  @param len the size of the user buffer, at least one struct dtmf_event
+ *  @param offset the cursor, the seq of the next event the file wants
+ *  @return the number of bytes copied, or a negative error number
+ */
+static ssize_t dtmfrx_read(struct file *filep, char __user *buf, size_t len, loff_t *offset){
+   struct dtmfrx_reader *reader = filep->private_data;
+   struct dtmfrx_dev *dtmf = reader->dtmf;
+   struct dtmf_event event, first = { 0 };
+   size_t copied = 0;
+   int result = 0;
+   u32 cursor, head;
+
+   if(READ_ONCE(dtmf->isDead)) return -ENODEV;
+   if(len < sizeof(struct dtmf_event)) return -EINVAL;
+   if(mutex_lock_interruptible(&reader->lock)) return -ERESTARTSYS;
+   while(!dtmfrx_pending(dtmf, *offset)){
+      mutex_unlock(&reader->lock);
+      if(READ_ONCE(dtmf->isDead)) return -ENODEV;   // Woken up by dtmfrx_remove()
+      if(filep->f_flags & O_NONBLOCK) return -EAGAIN;
+      if(wait_event_interruptible(dtmf->wait, dtmfrx_pending(dtmf, READ_ONCE(*offset)) ||
+                                  READ_ONCE(dtmf->isDead))) return -ERESTARTSYS;
+      dtmfrx_woken(dtmf);
+      if(mutex_lock_interruptible(&reader->lock)) return -ERESTARTSYS;
+   }
+   cursor = *offset;
+   head = smp_load_acquire(&dtmf->ring->head);
+   while(cursor != head && len - copied >= sizeof(event)){
+      if(dtmfrx_ring_get(dtmf, cursor, &event) < 0){   // Overwritten, the file fell behind
+         head = smp_load_acquire(&dtmf->ring->head);
+         dtmf_core_ring_lost(head, RING_SLOTS, cursor, ktime_get_ns(), &event);
+      }
+      if(copy_to_user(buf + copied, &event, sizeof(event))){
+         result = -EFAULT;
+         break;
+      }
+      if(!copied) first = event;
+      copied += sizeof(event);
+      cursor += dtmf_core_ring_skip(&event);
+   }
+   *offset = cursor;
+   mutex_unlock(&reader->lock);
+   if(copied) trace_dtmfrx_dequeue(dtmf->id, first.seq, first.ts_ns, copied / sizeof(event));
+   return copied ? copied : result;
+}
+
+/** @brief The poll function of /dev/dtmfN
+ *  A file is readable when the ring holds events past its cursor -- the position that read()
+ *  advances, or that a consumer of the mmap()ed ring sets with lseek(). Once the receiver is
+ *  unbound it reports a hang up.
+ */
+static __poll_t dtmfrx_poll(struct file *filep, poll_table *wait){
+   struct dtmfrx_reader *reader = filep->private_data;
+   struct dtmfrx_dev *dtmf = reader->dtmf;
+   bool ready;
+
+   poll_wait(filep, &dtmf->wait, wait);
+   if(READ_ONCE(dtmf->isDead)) return EPOLLHUP | EPOLLERR;
+   ready = dtmfrx_pending(dtmf, READ_ONCE(filep->f_pos));
+   if(ready) dtmfrx_woken(dtmf);
+   return ready ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/** @brief The llseek function of /dev/dtmfN
+ *  The position is the cursor of the file, the seq of the next event the caller wants. read()
+ *  starts there, and poll() on a file that has mmap()ed the ring knows what the consumer has
+ *  already seen. SEEK_END is the ring head, so lseek(fd, 0, SEEK_END) skips all the queued events.
+ */
+static loff_t dtmfrx_llseek(struct file *filep, loff_t offset, int whence){
+   struct dtmfrx_reader *reader = filep->private_data;
+
+   if(READ_ONCE(reader->dtmf->isDead)) return -ENODEV;
+   mutex_lock(&reader->lock);
+   switch(whence){
+   case SEEK_SET: break;
+   case SEEK_CUR: offset += filep->f_pos; break;
+   case SEEK_END: offset += smp_load_acquire(&reader->dtmf->ring->head); break;
+   default: offset = -1; break;
+   }
+   if(offset >= 0 && offset <= U32_MAX) WRITE_ONCE(filep->f_pos, offset);
+   mutex_unlock(&reader->lock);
+   return (offset < 0 || offset > U32_MAX) ? -EINVAL : offset;
+}
+
+/** @brief The mmap function of /dev/dtmfN -- maps the header page and the slots of the ring read-only */
+static int dtmfrx_mmap(struct file *filep, struct vm_area_struct *vma){
+   struct dtmfrx_reader *reader = filep->private_data;
+
+   if(READ_ONCE(reader->dtmf->isDead)) return -ENODEV;
+   if(vma->vm_flags & VM_WRITE) return -EPERM;   // Only the driver writes to the ring
+   vm_flags_clear(vma, VM_MAYWRITE);
+   return remap_vmalloc_range(vma, reader->dtmf->ring, vma->vm_pgoff);
+}
+
+/** @brief Replaces the patterns of a receiver -- the new automaton is compiled first, so the
+ *  IRQ thread switches from the old patterns to the new ones between two keys. Once there are
+ *  patterns no sequence is collected any more: the one that sequence mode was collecting is
+ *  queued now, so that seq_timer cannot queue it between the matches later.
+ *  @return 0 if successful, or a negative error number
+ */
+static int dtmfrx_set_patterns(struct dtmfrx_dev *dtmf, const struct dtmf_patterns __user *arg){
+   struct dtmfrx_matcher *matcher = NULL, *old;
+   struct dtmf_pattern *patterns = NULL;
+   struct dtmf_patterns req;
+   unsigned long flags;
+   u16 *scratch = NULL;
+   int result = 0, size, i;
+
+   if(copy_from_user(&req, arg, sizeof(req))) return -EFAULT;
+   if(req.reserved || req.count > DTMF_PATTERN_MAX) return -EINVAL;
+   if(req.count){
+      patterns = memdup_user(u64_to_user_ptr(req.patterns), req.count * sizeof(*patterns));
+      if(IS_ERR(patterns)) return PTR_ERR(patterns);
+      size = dtmf_core_ac_size(patterns, req.count);
+      for(i = 0; i < req.count && size > 0; i++)
+         if(memchr_inv(patterns[i].reserved, 0, sizeof(patterns[i].reserved))) size = -1;
+      if(size < 0){
+         result = -EINVAL;
+         goto out;
+      }
+      matcher = kvzalloc(struct_size(matcher, states, size), GFP_KERNEL);
+      scratch = kvmalloc_array(2 * size, sizeof(*scratch), GFP_KERNEL);
+      if(!matcher || !scratch){
+         kvfree(matcher);
+         result = -ENOMEM;
+         goto out;
+      }
+      dtmf_core_ac_build(matcher->states, patterns, req.count, scratch);
+      for(i = 0; i < req.count; i++){
+         matcher->ids[i] = patterns[i].id;
+         matcher->lens[i] = patterns[i].len;
+      }
+   }
+   mutex_lock(&dtmf->match_lock);
+   if(matcher) matcher->gen = ++dtmf->matchGen;
+   old = rcu_replace_pointer(dtmf->matcher, matcher, lockdep_is_held(&dtmf->match_lock));
+   mutex_unlock(&dtmf->match_lock);
+   if(old) kvfree_rcu(old, rcu);
+   if(matcher){
+      synchronize_irq(dtmf->irqNumber);          // An IRQ thread that missed the patterns is done with the key
+      spin_lock_irqsave(&dtmf->emit_lock, flags);
+      dtmfrx_seq_flush(dtmf, 0);
+      spin_unlock_irqrestore(&dtmf->emit_lock, flags);
+      hrtimer_cancel(&dtmf->seq_timer);          // Also waits for a timeout that is running
+      dtmfrx_wake(dtmf);
+   }
+out:
+   kvfree(scratch);
+   kfree(patterns);
+   return result;
+}
+
+/** @brief Whether the caller may change the receiver for every reader of /dev/dtmfN */
+static bool dtmfrx_may_change(struct file *filep){
+   return (filep->f_mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN);
+}
+
+/** @brief The ioctl function of /dev/dtmfN -- reads or resets all the counters, or sets the patterns
+ *  Any open file can read the counters. Resetting them or setting the patterns affects all the
+ *  readers, so it needs a file opened for writing, or CAP_SYS_ADMIN.
+ */
+static long dtmfrx_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   struct dtmfrx_reader *reader = filep->private_data;
+   struct dtmfrx_dev *dtmf = reader->dtmf;
+   const size_t head = offsetof(struct dtmf_stats, stat);
+   struct dtmf_stats stats;
+   size_t size;
+
+   if(READ_ONCE(dtmf->isDead)) return -ENODEV;
+   if(_IOC_TYPE(cmd) == DTMF_IOC_MAGIC && _IOC_NR(cmd) == _IOC_NR(DTMF_IOC_GET_STATS) &&
+      _IOC_DIR(cmd) == _IOC_READ){               // Any size, older programs know fewer counters
+      size = min_t(size_t, _IOC_SIZE(cmd), sizeof(stats));
+      if(size < head) return -EINVAL;
+      mutex_lock(&dtmf->stats_lock);
+      dtmfrx_stats_read(dtmf, &stats);
+      mutex_unlock(&dtmf->stats_lock);
+      stats.nr_stats = (size - head) / sizeof(stats.stat[0]);
+      return copy_to_user((void __user *)arg, &stats, size) ? -EFAULT : 0;
+   }
+   switch(cmd){
+   case DTMF_IOC_RESET_STATS:
+      if(!dtmfrx_may_change(filep)) return -EPERM;
+      dtmfrx_stats_reset(dtmf);
+      return 0;
+   case DTMF_IOC_SET_PATTERNS:
+      if(!dtmfrx_may_change(filep)) return -EPERM;
+      return dtmfrx_set_patterns(dtmf, (const struct dtmf_patterns __user *)arg);
+   default:
+      return -ENOTTY;
+   }
+}
+
+/** @brief Frees the context of a receiver once it is unbound and its last file is closed
+ *  The IRQ and the timers are long gone by then, so nothing can be using the patterns either.
+ */
+static void dtmfrx_free(struct kref *ref){
+   struct dtmfrx_dev *dtmf = container_of(ref, struct dtmfrx_dev, ref);
+
+   kvfree(rcu_dereference_protected(dtmf->matcher, 1));
+   vfree(dtmf->ring);
+   free_percpu(dtmf->stats);
+   mutex_destroy(&dtmf->match_lock);
+   mutex_destroy(&dtmf->stats_lock);
+   kfree(dtmf);
+}
+
+/** @brief Drops a reference to the context of a receiver */
+static void dtmfrx_put(struct dtmfrx_dev *dtmf){
+   kref_put(&dtmf->ref, dtmfrx_free);
+}
+
+/** @brief Drops the reference of the bound receiver, registered first so that it runs last */
+static void dtmfrx_unbind(void *data){
+   dtmfrx_put(data);
+}
+
+/** @brief The open function of /dev/dtmfN -- misc_open() points private_data at the miscdevice
+ *  The cursor of a new file starts at the ring head, it reads the events that come after the open.
+ *  misc_open() runs under the lock that misc_deregister() takes, so the receiver is still bound
+ *  and the reference taken here is never the first one.
+ */
+static int dtmfrx_open(struct inode *inodep, struct file *filep){
+   struct dtmfrx_reader *reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+   struct dtmfrx_dev *dtmf;
+   unsigned long flags;
+
+   if(!reader) return -ENOMEM;
+   dtmf = container_of(filep->private_data, struct dtmfrx_dev, miscdev);
+   kref_get(&dtmf->ref);
+   reader->dtmf = dtmf;
+   reader->file = filep;
+   mutex_init(&reader->lock);
+   filep->private_data = reader;
+   filep->f_pos = smp_load_acquire(&dtmf->ring->head);
+   spin_lock_irqsave(&dtmf->emit_lock, flags);
+   list_add_tail(&reader->node, &dtmf->readers);
+   spin_unlock_irqrestore(&dtmf->emit_lock, flags);
+   return 0;
+}
+
+/** @brief The release function of /dev/dtmfN -- the last file of an unbound receiver frees it */
+static int dtmfrx_release(struct inode *inodep, struct file *filep){
+   struct dtmfrx_reader *reader = filep->private_data;
+   unsigned long flags;
+
+   spin_lock_irqsave(&reader->dtmf->emit_lock, flags);
+   list_del(&reader->node);
+   spin_unlock_irqrestore(&reader->dtmf->emit_lock, flags);
+   dtmfrx_put(reader->dtmf);
+   mutex_destroy(&reader->lock);
+   kfree(reader);
+   return 0;
+}
+
+/** @brief The file operations of /dev/dtmfN */
+static const struct file_operations dtmfrx_fops = {
+   .owner   = THIS_MODULE,
+   .open    = dtmfrx_open,
+   .release = dtmfrx_release,
+   .read    = dtmfrx_read,
+   .poll    = dtmfrx_poll,
+   .mmap    = dtmfrx_mmap,
+   .unlocked_ioctl = dtmfrx_ioctl,
+   .compat_ioctl   = compat_ptr_ioctl,
+   .llseek  = dtmfrx_llseek,
+};
+
+/** @brief Allocates the mmap()able ring of a receiver, freed with the context by the last dtmfrx_put()
+ *  A mapping holds its file open, so the ring is never freed under it.
+ */
+static int dtmfrx_ring_init(struct dtmfrx_dev *dtmf){
+   unsigned int i;
+
+   BUILD_BUG_ON(!is_power_of_2(sizeof(struct dtmf_event)));
+   BUILD_BUG_ON(sizeof_field(struct dtmf_event, digits) != sizeof_field(struct dtmf_event, match));
+   dtmf->ring = vmalloc_user(PAGE_SIZE + RING_BYTES);   // Zeroed, and allowed to be mapped
+   if(!dtmf->ring) return -ENOMEM;
+   dtmf->ring_slots = (struct dtmf_event *)((char *)dtmf->ring + PAGE_SIZE);
+   dtmf->ring->version = DTMF_RING_VERSION;
+   dtmf->ring->nr_slots = RING_SLOTS;
+   dtmf->ring->slot_size = sizeof(struct dtmf_event);
+   dtmf->ring->data_offset = PAGE_SIZE;
+   for(i = 0; i < RING_SLOTS; i++)
+      dtmf->ring_slots[i].seq = i - RING_SLOTS;      // Not written yet for a consumer that wants seq i
+   return 0;
+}
+
+/** @brief Wakes up the readers sleeping in read() or poll(), if there are any */
+static void dtmfrx_wake(struct dtmfrx_dev *dtmf){
+   if(wq_has_sleeper(&dtmf->wait)){      // Implies the barrier that pairs with the sleeper
+      dtmfrx_stat_inc(dtmf, DTMF_STAT_WAKEUPS);
+      trace_dtmfrx_wakeup(dtmf->id);
+      atomic64_set(&dtmf->wake_ns, ktime_get_mono_fast_ns());
+      wake_up_interruptible(&dtmf->wait);
+   }
+}
+
+/** @brief The queue depth -- the events that the slowest open file has not read yet, at most RING_SLOTS
+ *  Must be called with emit_lock held. It walks the open files, so it only runs while the
+ *  dtmfrx_enqueue tracepoint is enabled.
+ */
+static unsigned int dtmfrx_depth(struct dtmfrx_dev *dtmf){
+   struct dtmfrx_reader *reader;
+   unsigned int depth = 0;
+   s32 behind;
+
+   lockdep_assert_held(&dtmf->emit_lock);
+   list_for_each_entry(reader, &dtmf->readers, node){
+      behind = dtmf->eventSeq - (u32)READ_ONCE(reader->file->f_pos);   // Negative if it seeked past the head
+      if(behind > 0) depth = max_t(unsigned int, depth, min_t(s32, behind, RING_SLOTS));
+   }
+   return depth;
+}
+
+/** @brief Publishes an event in the ring for every reader -- the cost is the same for any number of them
+ *  Must be called with emit_lock held, the caller wakes up the readers once the lock is dropped.
+ */
+static void dtmfrx_emit(struct dtmfrx_dev *dtmf, struct dtmf_event *event){
+   lockdep_assert_held(&dtmf->emit_lock);
+   event->seq = dtmf->eventSeq++;
+   dtmf_core_ring_put(dtmf->ring, dtmf->ring_slots, RING_SLOTS, event);   // read() and mmap() both pick it up
+   if(trace_dtmfrx_enqueue_enabled()) trace_dtmfrx_enqueue(dtmf->id, event, dtmfrx_depth(dtmf));
+}
+
+/** @brief Queues the sequence being collected, if any, as one DTMF_EVENT_SEQUENCE event
+ *  Must be called with emit_lock held.
+ *  @param terminator the key that completed the sequence, 0 if it timed out or is full
+ */
+static void dtmfrx_seq_flush(struct dtmfrx_dev *dtmf, char terminator){
+   struct dtmf_event event;
+
+   if(dtmf_core_seq_flush(&dtmf->sequence, terminator, &event))   // Unless nothing was collected
+      dtmfrx_emit(dtmf, &event);
+   hrtimer_try_to_cancel(&dtmf->seq_timer);      // No timeout is pending any more
+}
+
+/** @brief Adds a key to the sequence being collected and (re)arms the timeout
+ *  The sequence is queued at once when the terminator arrives or DTMF_SEQ_MAX keys were collected.
+ *  Otherwise seq_timer is set to the inter-digit timeout after this key, or to the completion
+ *  timeout after the first key if that comes earlier. Must be called with emit_lock held.
+ *  @return returns true if the sequence was queued
+ */
+static bool dtmfrx_seq_add(struct dtmfrx_dev *dtmf, u64 ts_ns, char digit){
+   struct dtmf_event event;
+   u64 expires;
+
+   if(dtmf_core_seq_add(&dtmf->sequence, ts_ns, digit, READ_ONCE(dtmf->seqTerminator), &event)){
+      dtmfrx_emit(dtmf, &event);
+      hrtimer_try_to_cancel(&dtmf->seq_timer);   // No timeout is pending any more
+      return true;
+   }
+   expires = dtmf_core_seq_expires(&dtmf->sequence, ts_ns, READ_ONCE(dtmf->seqTimeout),
+                                   READ_ONCE(dtmf->seqMaxTime));
+   hrtimer_start(&dtmf->seq_timer, ns_to_ktime(expires), HRTIMER_MODE_ABS);
+   return false;
+}
+
+/** @brief The sequence timeout -- queues the sequence being collected when no key came in time */
+static enum hrtimer_restart dtmfrx_seq_timeout(struct hrtimer *timer){
+   struct dtmfrx_dev *dtmf = container_of(timer, struct dtmfrx_dev, seq_timer);
+   unsigned long flags;
+
+   spin_lock_irqsave(&dtmf->emit_lock, flags);
+   if(!hrtimer_is_queued(timer))         // A key that arrived meanwhile has re-armed the timer
+      dtmfrx_seq_flush(dtmf, 0);
+   spin_unlock_irqrestore(&dtmf->emit_lock, flags);
+   dtmfrx_wake(dtmf);
+   return HRTIMER_NORESTART;
+}
+
+/** @brief Advances the pattern matcher by one key and queues a DTMF_EVENT_MATCH for every pattern it completes
+ *  A pause longer than the inter-digit timeout of sequence mode, or new patterns, start it over.
+ *  @return -1 if no patterns are registered, otherwise the number of matches queued
+ */
+static int dtmfrx_match(struct dtmfrx_dev *dtmf, u64 ts_ns, u8 nibble){
+   const struct dtmfrx_matcher *matcher;
+   struct dtmf_event event;
+   unsigned long flags;
+   int matches = 0, pattern;
+   u16 state;
+
+   rcu_read_lock();
+   matcher = rcu_dereference(dtmf->matcher);
+   if(!matcher){
+      rcu_read_unlock();
+      return -1;
+   }
+   if(matcher->gen != dtmf->matchStateGen ||
+      dtmf->ts_diff_ns > (u64)READ_ONCE(dtmf->seqTimeout) * NSEC_PER_USEC){
+      dtmf->matchStateGen = matcher->gen;
+      dtmf->match.state = 0;
+   }
+   state = dtmf_core_match_key(&dtmf->match, matcher->states, ts_ns, nibble);
+   spin_lock_irqsave(&dtmf->emit_lock, flags);
+   for(; state; state = matcher->states[state].dict, matches++){   // Every pattern that ends at this key
+      pattern = matcher->states[state].pattern;
+      dtmf_core_match_event(&dtmf->match, matcher->lens[pattern], matcher->ids[pattern], &event);
+      dtmfrx_emit(dtmf, &event);
+   }
+   spin_unlock_irqrestore(&dtmf->emit_lock, flags);
+   rcu_read_unlock();
+   return matches;
+}
+
+/** @brief Stops the timers, registered before the IRQ so that it runs after the IRQ is freed */
+static void dtmfrx_timers_stop(void *data){
+   struct dtmfrx_dev *dtmf = data;
+   hrtimer_cancel(&dtmf->debounce_timer);
+   hrtimer_cancel(&dtmf->seq_timer);
+}
+
+/** @brief Samples Q1..Q4 in one go
+ *  @return the Q4..Q1 code, or -1 if the lines could not be read
+ */
+static int dtmfrx_read_nibble(struct dtmfrx_dev *dtmf){
+   unsigned long nibble = 0;
+
+   if(gpiod_get_array_value(dtmf->data->ndescs, dtmf->data->desc, dtmf->data->info, &nibble))
+      return -1;
+   return nibble & 0x0f;
+}
+
+/** @brief Latches the current StD level for the threaded half -- must be called with capture_lock held
+ *  @param ts_ns the time of the StD edge
+ *  @param expect the Q4..Q1 code seen at the edge that the code must still match, -1 for any
+ *  @return true if an edge was queued and the threaded half must run
+ */
+static bool dtmfrx_latch(struct dtmfrx_dev *dtmf, u64 ts_ns, int expect){
+   struct dtmfrx_capture capture;
+   int nibble, edge;
+
+   lockdep_assert_held(&dtmf->capture_lock);
+   capture.ts_ns  = ts_ns;
+   capture.latch_ns = ktime_get_mono_fast_ns();
+   capture.level  = gpiod_get_value(dtmf->std) > 0;
+   capture.decode = false;
+   capture.nibble = 0;
+   edge = dtmf_core_edge(&dtmf->stdLevel, capture.level, isRising);
+   if(edge == DTMF_CORE_GLITCH){                 // StD did not change since the last edge
+      dtmfrx_stat_inc(dtmf, DTMF_STAT_SPURIOUS);
+      return false;
+   }
+   if(edge == DTMF_CORE_TONE){                   // The edge that latches a tone
+      dtmfrx_stat_inc(dtmf, DTMF_STAT_TONES);
+      nibble = dtmfrx_read_nibble(dtmf);
+      if(nibble < 0 || (expect >= 0 && nibble != expect))
+         dtmfrx_stat_inc(dtmf, DTMF_STAT_INVALID);  // Q1..Q4 unreadable or not stable, only time the edge
+      else {
+         capture.decode = true;
+         capture.nibble = nibble;
+         trace_dtmfrx_irq(dtmf->id, capture.nibble, capture.ts_ns);
+      }
+   }
+   if(!kfifo_put(&dtmf->capture_fifo, capture)){    // The threaded half has fallen far behind
+      dtmfrx_stat_inc(dtmf, DTMF_STAT_OVERFLOWS);
+      return false;
+   }
+   return true;
+}
+
+/** @brief The glitch filter timer -- StD has not changed for debounceTime since its last edge
+ *  Latches the edge with the time of the first edge of the burst, provided that StD really changed
+ *  and the code on Q1..Q4 is the one seen at the last edge, and wakes up the threaded half.
+ */
+static enum hrtimer_restart dtmfrx_debounce_timeout(struct hrtimer *timer){
+   struct dtmfrx_dev *dtmf = container_of(timer, struct dtmfrx_dev, debounce_timer);
+   unsigned long flags;
+   bool latched;
+
+   raw_spin_lock_irqsave(&dtmf->capture_lock, flags);
+   if(!dtmf->edge_ns || dtmf->isPolling){        // The IRQ storm took the edge over while this waited for the lock
+      raw_spin_unlock_irqrestore(&dtmf->capture_lock, flags);
+      return HRTIMER_NORESTART;
+   }
+   if(hrtimer_is_queued(timer)){                 // A bounce that came in meanwhile has re-armed the timer
+      raw_spin_unlock_irqrestore(&dtmf->capture_lock, flags);
+      return HRTIMER_NORESTART;
+   }
+   latched = dtmfrx_latch(dtmf, dtmf->edge_ns, dtmf->edge_nibble);
+   dtmf->edge_ns = 0;
+   raw_spin_unlock_irqrestore(&dtmf->capture_lock, flags);
+   if(latched) irq_wake_thread(dtmf->irqNumber, dtmf);
+   return HRTIMER_NORESTART;
+}
+
+/** @brief The polling mode timer -- samples StD at a bounded rate while the IRQ is disabled
+ *  An StD level is only taken as an edge once two samples in a row agree, so the edges are found
+ *  with a resolution of pollInterval. Once a whole window saw less than half of the StD changes
+ *  that made the IRQ storm, the IRQ is enabled again.
+ */
+static enum hrtimer_restart dtmfrx_poll_timeout(struct hrtimer *timer){
+   struct dtmfrx_dev *dtmf = container_of(timer, struct dtmfrx_dev, poll_timer);
+   unsigned int limit = DIV_ROUND_UP(READ_ONCE(dtmf->stormThreshold), STORM_WINDOWS);
+   u64 ts_ns = ktime_get_mono_fast_ns();
+   bool latched = false, quiet = false;
+   unsigned long flags;
+   long ended;
+   int moved;
+
+   raw_spin_lock_irqsave(&dtmf->capture_lock, flags);
+   dtmfrx_stat_inc(dtmf, DTMF_STAT_POLLS);
+   moved = dtmf_core_poll(&dtmf->poll_level, dtmf->stdLevel, gpiod_get_value(dtmf->std) > 0);
+   ended = dtmf_core_rate_count(&dtmf->storm, ts_ns, NSEC_PER_SEC / STORM_WINDOWS, moved == 1);
+   if(moved == 2)                                // A stable edge
+      latched = dtmfrx_latch(dtmf, ts_ns, -1);
+   if(ended >= 0 && (!limit || ended * 2 < limit)){
+      dtmf->isPolling = false;                   // Back to interrupt mode
+      quiet = true;
+   }
+   raw_spin_unlock_irqrestore(&dtmf->capture_lock, flags);
+   if(latched) irq_wake_thread(dtmf->irqNumber, dtmf);
+   if(quiet){
+      enable_irq(dtmf->irqNumber);
+      return HRTIMER_NORESTART;
+   }
+   hrtimer_forward_now(timer, us_to_ktime(READ_ONCE(dtmf->pollInterval)));
+   return HRTIMER_RESTART;
+}
+
+/** @brief Leaves polling mode for good, registered after the IRQ so that it runs before the IRQ is freed */
+static void dtmfrx_poll_stop(void *data){
+   struct dtmfrx_dev *dtmf = data;
+   unsigned long flags;
+
+   raw_spin_lock_irqsave(&dtmf->capture_lock, flags);
+   dtmf->isStopping = true;
+   raw_spin_unlock_irqrestore(&dtmf->capture_lock, flags);
+   hrtimer_cancel(&dtmf->poll_timer);
+   if(dtmf->isPolling){                          // The IRQ must be balanced before it is freed
+      dtmf->isPolling = false;
+      enable_irq(dtmf->irqNumber);
+   }
+}
+
+/** @brief The GPIO IRQ Handler function -- the hard half
+ *  This function is a custom interrupt handler that is attached to the StD GPIO of a receiver. It
+ *  runs with interrupts masked, so it does as little as possible: it latches the StD level and a
+ *  monotonic timestamp into the capture queue and defers everything else to dtmfrx_irq_thread().
+ *  Both StD edges interrupt so that the tone duration can be measured, but the data nibble is only
+ *  sampled on the edge selected by isRising. With the glitch filter on, every edge only (re)arms
+ *  debounce_timer, and the edge is latched by dtmfrx_debounce_timeout() once StD is stable.
+ *  If the IRQ rate goes above stormThreshold, a noisy line or a floating StD pin, the IRQ is
+ *  disabled and StD is sampled by dtmfrx_poll_timeout() instead, so the CPU cost stays bounded.
+ *  This function is static as it should not be invoked directly from outside of this file.
+ *  @param irq    the IRQ number that is associated with the GPIO -- useful for logging.
+ *  @param dev_id the struct dtmfrx_dev of the receiver that caused the interrupt
+ *  return returns IRQ_WAKE_THREAD so that the captured tone is processed by the threaded half.
+ */
+static irqreturn_t dtmfrx_irq_handler(int irq, void *dev_id){
+   struct dtmfrx_dev *dtmf = dev_id;
+   unsigned int debounce = READ_ONCE(dtmf->debounceTime);
+   unsigned int threshold = READ_ONCE(dtmf->stormThreshold);
+   u64 ts_ns, duration;
+
+   irqreturn_t result = IRQ_HANDLED;
+
+   ts_ns = ktime_get_mono_fast_ns();             // NMI-safe and cheap, usable with interrupts masked
+   raw_spin_lock(&dtmf->capture_lock);
+   dtmf_core_rate_count(&dtmf->storm, ts_ns, NSEC_PER_SEC / STORM_WINDOWS, 1);
+   if(threshold && dtmf->storm.count > DIV_ROUND_UP(threshold, STORM_WINDOWS) && !dtmf->isStopping){
+      disable_irq_nosync(irq);                   // An IRQ storm, sample StD at a bounded rate instead
+      dtmfrx_stat_inc(dtmf, DTMF_STAT_STORMS);
+      dtmf->isPolling = true;
+      dtmf->poll_level = dtmf->stdLevel;
+      dtmf_core_rate_reset(&dtmf->storm, ts_ns);
+      hrtimer_try_to_cancel(&dtmf->debounce_timer);   // An edge that is still bouncing is found by polling
+      dtmf->edge_ns = 0;
+      hrtimer_start(&dtmf->poll_timer, us_to_ktime(READ_ONCE(dtmf->pollInterval)), HRTIMER_MODE_REL_HARD);
+   }
+   else if(debounce){                                 // Wait until StD is stable, every bounce restarts the window
+      if(!dtmf->edge_ns) dtmf->edge_ns = ts_ns;  // The tone is timed from the first edge of a burst
+      dtmf->edge_nibble = (gpiod_get_value(dtmf->std) > 0) == isRising ? dtmfrx_read_nibble(dtmf) : -1;
+      hrtimer_start(&dtmf->debounce_timer, us_to_ktime(debounce), HRTIMER_MODE_REL_HARD);
+   }
+   else if(dtmfrx_latch(dtmf, ts_ns, -1))
+      result = IRQ_WAKE_THREAD;                  // Run dtmfrx_irq_thread() for the rest
+   raw_spin_unlock(&dtmf->capture_lock);
+   duration = ktime_get_mono_fast_ns() - ts_ns;
+   if(duration > dtmf->irqMaxTime) WRITE_ONCE(dtmf->irqMaxTime, duration);   // Worst-case time spent in here
+   return result;
+}
 
-/**  The attribute group uses the attribute array and a name, which is exposed on sysfs -- in this
- *  case it is gpio73, which is automatically defined in the dtmfrx_init() function below
- *  using the custom kernel parameter that can be passed when the module is loaded.
+/** @brief Reports a key on the input device with the time of the StD edge
+ *  @param code the key code, or KEY_RESERVED to release the key that is held down
+ *  @param nibble the Q4..Q1 code of the key, reported as its scan code
  */
-static struct attribute_group attr_group = {
-      .name  = gpioName,                 ///< The name is generated in ebbButton_init()
-      .attrs = dtmf_attrs,                ///< The attributes array defined just above
+static void dtmfrx_input_key(struct dtmfrx_dev *dtmf, u64 ts_ns, unsigned int code, u8 nibble){
+   input_set_timestamp(dtmf->input, ns_to_ktime(ts_ns));
+   if(code != KEY_RESERVED){
+      input_event(dtmf->input, EV_MSC, MSC_SCAN, nibble);
+      input_report_key(dtmf->input, code, 1);
+   }
+   else
+      input_report_key(dtmf->input, dtmf->inputCode, 0);
+   input_sync(dtmf->input);
+   dtmf->inputCode = code;
+}
+
+/** @brief Follows an StD edge on the input device -- the key is down for as long as StD is high
+ *  @param rise_ns the time of the StD rising edge before this one, 0 if unknown
+ */
+static void dtmfrx_input_edge(struct dtmfrx_dev *dtmf, const struct dtmfrx_capture *capture, u64 rise_ns){
+   if(!dtmf->input) return;
+   if(capture->decode){
+      if(dtmf->inputCode != KEY_RESERVED)        // The release was missed
+         dtmfrx_input_key(dtmf, capture->ts_ns, KEY_RESERVED, 0);
+      // When the tone is latched on the falling edge, the key went down when StD rose
+      dtmfrx_input_key(dtmf, capture->level || !rise_ns ? capture->ts_ns : rise_ns,
+                       READ_ONCE(dtmf->keycodes[capture->nibble]), capture->nibble);
+   }
+   if(!capture->level && dtmf->inputCode != KEY_RESERVED)
+      dtmfrx_input_key(dtmf, capture->ts_ns, KEY_RESERVED, 0);
+}
+
+/** @brief The GPIO IRQ Handler function -- the threaded half
+ *  Runs in a kernel thread with interrupts enabled. It drains every edge latched by
+ *  dtmfrx_irq_handler(), times it into the histograms, and for every tone it decodes it, updates
+ *  the LED, the counters and the sysfs values, and queues the event for /dev/dtmfN.
+ *  @param irq    the IRQ number that is associated with the GPIO -- useful for logging.
+ *  @param dev_id the struct dtmfrx_dev of the receiver that caused the interrupt
+ *  return returns IRQ_HANDLED
+ */
+static irqreturn_t dtmfrx_irq_thread(int irq, void *dev_id){
+   struct dtmfrx_dev *dtmf = dev_id;
+   struct dtmfrx_capture capture;
+   struct dtmf_event event;
+   unsigned long flags;
+   int matches;
+   u64 rise_ns;
+
+   while(kfifo_get(&dtmf->capture_fifo, &capture)){
+      dtmfrx_hist_add(dtmf, HIST_IRQ_LATENCY, ktime_get_mono_fast_ns() - capture.latch_ns);
+      rise_ns = dtmf->rise_ns;
+      if(capture.level)                  // StD rose, the tone starts
+         dtmf->rise_ns = capture.ts_ns;
+      else if(dtmf->rise_ns){            // StD fell, the tone ends
+         dtmfrx_hist_add(dtmf, HIST_TONE_DURATION, capture.ts_ns - dtmf->rise_ns);
+         dtmf->rise_ns = 0;
+      }
+      dtmfrx_input_edge(dtmf, &capture, rise_ns);
+      if(!capture.decode) continue;      // Only timed, no tone was latched on this edge
+      dtmf->DTMFdigit = capture.nibble;           ///< DTMF Digit received
+      dtmf->ledOn = true;                // Light the LED on each button press
+      if(dtmf->led) gpiod_set_value_cansleep(dtmf->led, dtmf->ledOn);   // Set the physical LED accordingly
+      WRITE_ONCE(dtmf->ts_diff_ns, capture.ts_ns - dtmf->ts_last_ns);   // Determine the time difference between last 2 presses
+      if(dtmf->digit)                    // There is no interval before the first key
+         dtmfrx_hist_add(dtmf, HIST_DIGIT_INTERVAL, dtmf->ts_diff_ns);
+      WRITE_ONCE(dtmf->ts_last_ns, capture.ts_ns);   // Store the time of this press as the last time
+      dtmf->digit = dtmf_core_key(capture.nibble);  // Table lookup, every 4-bit code is a valid key
+      dtmfrx_stat_inc(dtmf, DTMF_STAT_DIGITS);    // Per receiver counters, will be outputted when the module is unloaded
+      this_cpu_inc(dtmf->stats->keys[capture.nibble]);
+      trace_dtmfrx_decode(dtmf->id, capture.nibble, dtmf->digit, capture.ts_ns);
+      matches = dtmfrx_match(dtmf, capture.ts_ns, capture.nibble);
+      if(matches >= 0){                  // Patterns are registered, only the matches are queued
+         if(matches) dtmfrx_wake(dtmf);
+         continue;
+      }
+      spin_lock_irqsave(&dtmf->emit_lock, flags);
+      if(dtmf->isSequence){              // Collect the key, readers are only woken for a whole sequence
+         if(!dtmfrx_seq_add(dtmf, capture.ts_ns, dtmf->digit)){
+            spin_unlock_irqrestore(&dtmf->emit_lock, flags);
+            continue;
+         }
+      }
+      else {
+         memset(&event, 0, sizeof(event));
+         event.type = DTMF_EVENT_DIGIT;
+         event.ts_ns = capture.ts_ns;
+         event.digit = dtmf->digit;
+         event.nibble = capture.nibble;
+         dtmfrx_emit(dtmf, &event);
+      }
+      spin_unlock_irqrestore(&dtmf->emit_lock, flags);
+      dtmfrx_wake(dtmf);                 // ... and wake up any reader waiting for it
+   }
+   return IRQ_HANDLED;                   // Announce that the IRQ has been handled correctly
+}
+
+/** @brief Prints one histogram in debugfs, one "from - to count" line per bucket that is not empty
+ *  The times are in ns, the counts are since the last reset of the counters.
+ */
+static int dtmfrx_hist_show(struct seq_file *m, void *v){
+   const struct dtmfrx_hist_file *file = m->private;
+   struct dtmfrx_dev *dtmf = file->dtmf;
+   u64 hist[HIST_BUCKETS], total = 0;
+   int i;
+
+   mutex_lock(&dtmf->stats_lock);
+   dtmfrx_hist_read(dtmf, file->index, hist);
+   mutex_unlock(&dtmf->stats_lock);
+   for(i = 0; i < HIST_BUCKETS; i++){
+      total += hist[i];
+      if(!hist[i]) continue;
+      if(i == HIST_BUCKETS - 1)
+         seq_printf(m, "%12llu -          inf %10llu\n", 1ULL << (i - 1), hist[i]);
+      else
+         seq_printf(m, "%12llu - %12llu %10llu\n", i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1, hist[i]);
+   }
+   seq_printf(m, "total %llu\n", total);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dtmfrx_hist);
+
+/** @brief Creates /sys/kernel/debug/dtmf_rx/dtmfN with one file per histogram
+ *  debugfs is optional, so a failure is not an error and is not even reported.
+ */
+static void dtmfrx_debugfs_init(struct dtmfrx_dev *dtmf){
+   static const char * const names[HIST_NR] = {
+      "irqLatency", "wakeLatency", "digitInterval", "toneDuration"
+   };
+   int i;
+
+   dtmf->debugfs = debugfs_create_dir(dtmf->miscdev.name, dtmfrx_debugfs);
+   for(i = 0; i < HIST_NR; i++){
+      dtmf->histFiles[i].dtmf = dtmf;
+      dtmf->histFiles[i].index = i;
+      debugfs_create_file(names[i], 0444, dtmf->debugfs, &dtmf->histFiles[i], &dtmfrx_hist_fops);
+   }
+}
+
+/** @brief Registers the keypad input device of a receiver
+ *  The keymap can be changed with EVIOCSKEYCODE, the scan code of a key is its Q4..Q1 code.
+ */
+static int dtmfrx_input_init(struct dtmfrx_dev *dtmf){
+   struct device *dev = dtmf->dev;
+   struct input_dev *input;
+   int result, i;
+
+   input = devm_input_allocate_device(dev);
+   if(!input) return -ENOMEM;
+   input->name = "MT88L70 DTMF receiver";
+   input->phys = devm_kasprintf(dev, GFP_KERNEL, "%s/input0", dev_name(dev));
+   if(!input->phys) return -ENOMEM;
+   input->id.bustype = BUS_HOST;
+   memcpy(dtmf->keycodes, dtmfrx_keycodes, sizeof(dtmf->keycodes));
+   input->keycode = dtmf->keycodes;
+   input->keycodesize = sizeof(dtmf->keycodes[0]);
+   input->keycodemax = ARRAY_SIZE(dtmf->keycodes);
+   __set_bit(EV_KEY, input->evbit);
+   for(i = 0; i < ARRAY_SIZE(dtmf->keycodes); i++) __set_bit(dtmf->keycodes[i], input->keybit);
+   input_set_capability(input, EV_MSC, MSC_SCAN);
+   result = input_register_device(input);
+   if(!result) dtmf->input = input;
+   return result;
+}
+
+/** @brief Releases the N of /dev/dtmfN when the receiver goes away */
+static void dtmfrx_id_free(void *data){
+   struct dtmfrx_dev *dtmf = data;
+   ida_free(&dtmfrx_ida, dtmf->id);
+}
+
+/** @brief Gets the GPIOs of a receiver that was given as module parameters
+ *  The legacy GPIO numbers are requested one by one and wrapped into the same descriptors that
+ *  a device tree receiver gets. The data lines have no gpio_array info, so they are read one
+ *  register at a time -- describe the receiver in the device tree for the single bank read.
+ */
+static int dtmfrx_get_legacy_gpios(struct dtmfrx_dev *dtmf, const struct dtmfrx_platform_data *pdata){
+   struct device *dev = dtmf->dev;
+   int result, i;
+
+   result = devm_gpio_request_one(dev, pdata->gpioDTMFdetected, GPIOF_IN, "DTMFdetected");
+   if(result) return result;
+   dtmf->std = gpio_to_desc(pdata->gpioDTMFdetected);
+   dtmf->data = devm_kzalloc(dev, struct_size(dtmf->data, desc, DATA_LINES), GFP_KERNEL);
+   if(!dtmf->data) return -ENOMEM;
+   dtmf->data->ndescs = DATA_LINES;
+   for(i = 0; i < DATA_LINES; i++){
+      result = devm_gpio_request_one(dev, pdata->gpioDTMFdata[i], GPIOF_IN, "DTMFdata");
+      if(result) return result;
+      dtmf->data->desc[i] = gpio_to_desc(pdata->gpioDTMFdata[i]);
+   }
+   if(pdata->gpioDTMFpd >= 0){
+      result = devm_gpio_request_one(dev, pdata->gpioDTMFpd, GPIOF_OUT_INIT_LOW, "DTMFpd");
+      if(result) return result;
+      dtmf->pd = gpio_to_desc(pdata->gpioDTMFpd);
+   }
+   if(pdata->gpioLED >= 0){
+      result = devm_gpio_request_one(dev, pdata->gpioLED, GPIOF_OUT_INIT_LOW, "DTMFled");
+      if(result) return result;
+      dtmf->led = gpio_to_desc(pdata->gpioLED);
+   }
+   return 0;
+}
+
+/** @brief Gets the GPIOs of a receiver that is described by a device tree or ACPI node
+ *  std-gpios, data-gpios (Q1..Q4 in that order), and the optional pd-gpios and led-gpios.
+ */
+static int dtmfrx_get_fw_gpios(struct dtmfrx_dev *dtmf){
+   struct device *dev = dtmf->dev;
+
+   dtmf->std = devm_gpiod_get(dev, "std", GPIOD_IN);
+   if(IS_ERR(dtmf->std)) return PTR_ERR(dtmf->std);
+   dtmf->data = devm_gpiod_get_array(dev, "data", GPIOD_IN);
+   if(IS_ERR(dtmf->data)) return PTR_ERR(dtmf->data);
+   if(dtmf->data->ndescs != DATA_LINES){
+      dev_err(dev, "data-gpios must list the %d lines Q1..Q4\n", DATA_LINES);
+      return -EINVAL;
+   }
+   dtmf->pd = devm_gpiod_get_optional(dev, "pd", GPIOD_OUT_LOW);
+   if(IS_ERR(dtmf->pd)) return PTR_ERR(dtmf->pd);
+   dtmf->led = devm_gpiod_get_optional(dev, "led", GPIOD_OUT_LOW);
+   if(IS_ERR(dtmf->led)) return PTR_ERR(dtmf->led);
+   return 0;
+}
+
+/** @brief Binds the driver to one receiver
+ *  Sets up the GPIOs, the IRQ and /dev/dtmfN of the receiver, and links its sysfs directory
+ *  into /sys/dtmf under the name of its StD GPIO.
+ *  @return returns 0 if successful
+ */
+static int dtmfrx_probe(struct platform_device *pdev){
+   struct device *dev = &pdev->dev;
+   const struct dtmfrx_platform_data *pdata = dev_get_platdata(dev);
+   unsigned long IRQflags = IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING;   // isRising picks the edge that latches the tone
+   struct dtmfrx_dev *dtmf;
+   int result;
+
+   dtmf = kzalloc(sizeof(*dtmf), GFP_KERNEL);
+   if(!dtmf) return -ENOMEM;
+   kref_init(&dtmf->ref);
+   dtmf->dev = dev;
+   dtmf->debounceTime = DEBOUNCE_TIME;
+   dtmf->edge_nibble = -1;
+   dtmf->seqTimeout = SEQ_TIMEOUT;
+   dtmf->seqTerminator = '#';
+   spin_lock_init(&dtmf->emit_lock);
+   raw_spin_lock_init(&dtmf->capture_lock);
+   hrtimer_init(&dtmf->debounce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+   dtmf->debounce_timer.function = dtmfrx_debounce_timeout;
+   dtmf->stormThreshold = STORM_THRESHOLD;
+   dtmf->pollInterval = POLL_INTERVAL;
+   hrtimer_init(&dtmf->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+   dtmf->poll_timer.function = dtmfrx_poll_timeout;
+   hrtimer_init(&dtmf->seq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   dtmf->seq_timer.function = dtmfrx_seq_timeout;
+   INIT_KFIFO(dtmf->capture_fifo);
+   init_waitqueue_head(&dtmf->wait);
+   INIT_LIST_HEAD(&dtmf->readers);
+   mutex_init(&dtmf->stats_lock);
+   mutex_init(&dtmf->match_lock);
+   result = devm_add_action_or_reset(dev, dtmfrx_unbind, dtmf);   // The first action, so it runs last
+   if(result) return result;
+   dtmf->stats = alloc_percpu(struct dtmfrx_pcpu_stats);
+   if(!dtmf->stats) return -ENOMEM;
+   platform_set_drvdata(pdev, dtmf);
+   result = dtmfrx_ring_init(dtmf);
+   if(result) return result;
+
+   result = pdata ? dtmfrx_get_legacy_gpios(dtmf, pdata) : dtmfrx_get_fw_gpios(dtmf);
+   if(result) return dev_err_probe(dev, result, "failed to get the GPIOs\n");
+   dtmf->ts_last_ns = ktime_get_mono_fast_ns();     // set the last time to be the current time
+   dtmf->stdLevel = gpiod_get_value_cansleep(dtmf->std) > 0;   // The first IRQ must change it
+
+   result = devm_add_action_or_reset(dev, dtmfrx_timers_stop, dtmf);
+   if(result) return result;
+   dtmf->id = ida_alloc(&dtmfrx_ida, GFP_KERNEL);  // Before the IRQ, the tracepoints report it
+   if(dtmf->id < 0) return dtmf->id;
+   result = devm_add_action_or_reset(dev, dtmfrx_id_free, dtmf);
+   if(result) return result;
+
+   if(useInput){                                   // Before the IRQ, so that it goes away after the IRQ
+      result = dtmfrx_input_init(dtmf);
+      if(result) return dev_err_probe(dev, result, "failed to register the input device\n");
+   }
+
+   /// GPIO numbers and IRQ numbers are not the same! This function performs the mapping for us
+   dtmf->irqNumber = gpiod_to_irq(dtmf->std);
+   if(dtmf->irqNumber < 0) return dev_err_probe(dev, dtmf->irqNumber, "StD has no IRQ\n");
+   // This next call requests an interrupt line with a hard half and a threaded half
+   result = devm_request_threaded_irq(dev, dtmf->irqNumber,
+                        dtmfrx_irq_handler,    // The hard half, only latches the tone
+                        dtmfrx_irq_thread,     // The threaded half, decodes and queues the tone
+                        IRQflags,              // Use the custom kernel param to set interrupt type
+                        dev_name(dev),         // Used in /proc/interrupts to identify the owner
+                        dtmf);                 // The *dev_id tells the handlers which receiver fired
+   if(result) return dev_err_probe(dev, result, "failed to request IRQ %d\n", dtmf->irqNumber);
+   result = devm_add_action_or_reset(dev, dtmfrx_poll_stop, dtmf);
+   if(result) return result;
+
+   dtmf->miscdev.minor  = MISC_DYNAMIC_MINOR;
+   dtmf->miscdev.name   = devm_kasprintf(dev, GFP_KERNEL, "dtmf%d", dtmf->id);
+   dtmf->miscdev.fops   = &dtmfrx_fops;
+   dtmf->miscdev.mode   = 0664;              // Anyone can read, the owner and group can also set the patterns
+   dtmf->miscdev.parent = dev;
+   result = dtmf->miscdev.name ? misc_register(&dtmf->miscdev) : -ENOMEM;   // create /dev/dtmfN
+   if(result) return dev_err_probe(dev, result, "failed to register /dev/dtmf%d\n", dtmf->id);
+   // link the attributes into /sys/dtmf -- for example, /sys/dtmf/gpio73/numberPresses
+   snprintf(dtmf->gpioName, sizeof(dtmf->gpioName), "gpio%d", desc_to_gpio(dtmf->std));
+   if(sysfs_create_link(dtmfrx_kobj, &dev->kobj, dtmf->gpioName))
+      dev_warn(dev, "failed to create /sys/dtmf/%s\n", dtmf->gpioName);
+   dtmfrx_debugfs_init(dtmf);
+   dev_info(dev, "/dev/%s on IRQ %d, the DTMF detected GPIO state is currently: %d\n",
+            dtmf->miscdev.name, dtmf->irqNumber, gpiod_get_value_cansleep(dtmf->std));
+   return 0;
+}
+
+/** @brief Unbinds the driver from one receiver -- the GPIOs and the IRQ are released by devm */
+static int dtmfrx_remove(struct platform_device *pdev){
+   struct dtmfrx_dev *dtmf = platform_get_drvdata(pdev);
+
+   dev_info(&pdev->dev, "The dtmf was detected %llu times\n", dtmfrx_stat_get(dtmf, DTMF_STAT_DIGITS));
+   debugfs_remove_recursive(dtmf->debugfs);
+   sysfs_remove_link(dtmfrx_kobj, dtmf->gpioName);
+   misc_deregister(&dtmf->miscdev);           // remove /dev/dtmfN, no new file can open it
+   WRITE_ONCE(dtmf->isDead, true);
+   wake_up_interruptible_all(&dtmf->wait);    // The files that are still open get -ENODEV
+   dtmf->ledOn = false;
+   if(dtmf->led) gpiod_set_value_cansleep(dtmf->led, dtmf->ledOn);   // Turn the LED off, makes it clear the device was unloaded
+   return 0;
+}
+
+/** @brief Device tree match table, also used for ACPI through the PRP0001 _HID */
+static const struct of_device_id dtmfrx_of_match[] = {
+   { .compatible = "mitel,mt88l70" },
+   { }
+};
+MODULE_DEVICE_TABLE(of, dtmfrx_of_match);
+
+static struct platform_driver dtmfrx_driver = {
+   .probe  = dtmfrx_probe,
+   .remove = dtmfrx_remove,
+   .driver = {
+      .name           = DRIVER_NAME,
+      .of_match_table = dtmfrx_of_match,
+      .dev_groups     = dtmf_groups,     // sysfs attributes of every receiver
+   },
 };
 
-static struct kobject *dtmfrx_kobj;
+/** @brief Creates one platform device for every receiver given as module parameters
+ *  @return returns 0 if successful
+ */
+static int __init dtmfrx_add_legacy(void){
+   struct dtmfrx_platform_data pdata;
+   int i;
+
+   for(i = 0; i < numDetected; i++){
+      if(i >= numData1 || i >= numData2 || i >= numData3 || i >= numData4){
+         printk(KERN_ALERT "DTMF DETECTED: receiver %d needs all of gpioDTMFdata1..4\n", i);
+         return -EINVAL;
+      }
+      pdata.gpioDTMFdetected = gpioDTMFdetected[i];
+      pdata.gpioDTMFdata[0] = gpioDTMFdata1[i];
+      pdata.gpioDTMFdata[1] = gpioDTMFdata2[i];
+      pdata.gpioDTMFdata[2] = gpioDTMFdata3[i];
+      pdata.gpioDTMFdata[3] = gpioDTMFdata4[i];
+      pdata.gpioDTMFpd = i < numPd ? gpioDTMFpd[i] : -1;
+      pdata.gpioLED = i < numLED ? gpioLED[i] : -1;
+      legacyDevs[i] = platform_device_register_data(NULL, DRIVER_NAME, i, &pdata, sizeof(pdata));
+      if(IS_ERR(legacyDevs[i])){
+         int result = PTR_ERR(legacyDevs[i]);
+         legacyDevs[i] = NULL;
+         return result;
+      }
+   }
+   return 0;
+}
+
+/** @brief Removes the platform devices created by dtmfrx_add_legacy() */
+static void dtmfrx_del_legacy(void){
+   int i;
+   for(i = 0; i < MAX_LEGACY; i++){
+      platform_device_unregister(legacyDevs[i]);   // NULL is ignored
+      legacyDevs[i] = NULL;
+   }
+}
 
 /** @brief The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file. The __init
  *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
  *  time and that it can be discarded and its memory freed up after that point. In this example this
- *  function sets up the GPIOs and the IRQ
+ *  function creates /sys/dtmf and registers the driver; the receivers are set up in dtmfrx_probe()
  *  @return returns 0 if successful
  */
 static int __init dtmfrx_init(void){
    int result = 0;
-   unsigned long IRQflags = IRQF_TRIGGER_RISING;      // The default is a rising-edge interrupt
 
    printk(KERN_INFO "DTMF DETECTED: Initializing the DTMF DETECTED @TOE LKM\n");
-   sprintf(gpioName, "gpio%d", gpioDTMFdetected);           // Create the gpio73 name for /sys/dtmf/gpio73
 
    // create the kobject sysfs entry at /sys/dtmf
    dtmfrx_kobj = kobject_create_and_add("dtmf", kernel_kobj->parent); // kernel_kobj points to /sys/kernel
@@ -235,54 +1682,23 @@ static int __init dtmfrx_init(void){
       printk(KERN_ALERT "DTMF DETECTED: failed to create kobject mapping\n");
       return -ENOMEM;
    }
-   // add the attributes to /sys/dtmf/ -- for example, /sys/dtmf/gpio73/numberPresses
-   result = sysfs_create_group(dtmfrx_kobj, &attr_group);
+   dtmfrx_debugfs = debugfs_create_dir("dtmf_rx", NULL);   // the histograms, optional
+   result = platform_driver_register(&dtmfrx_driver);
    if(result) {
-      printk(KERN_ALERT "DTMF DETECTED: failed to create sysfs group\n");
+      printk(KERN_ALERT "DTMF DETECTED: failed to register the platform driver\n");
+      debugfs_remove_recursive(dtmfrx_debugfs);
       kobject_put(dtmfrx_kobj);                          // clean up -- remove the kobject sysfs entry
       return result;
    }
-   getnstimeofday(&ts_last);                          // set the last time to be the current time
-   ts_diff = timespec_sub(ts_last, ts_last);          // set the initial time difference to be 0
-
-   // Going to set up the LED. It is a GPIO in output mode and will be off by default
-   ledOn = false;
-   gpio_request(gpioLED, "sysfs");          // gpioLED is hardcoded to51, request it
-   gpio_direction_output(gpioLED, ledOn);   // Set the gpio to be in output mode and off
-// gpio_set_value(gpioLED, ledOn);          // Not required as set by line above (here for reference)
-   gpio_export(gpioLED, false);             // Causes gpio51 to appear in /sys/class/gpio
-                                            // the bool argument prevents the direction from being changed
-   gpio_request(gpioDTMFdetected, "sysfs");       // Set up the gpioDTMFdetected
-  gpio_direction_input(gpioDTMFdetected);        // Set the DTMF detected GPIO to be an input
-  gpio_set_debounce(gpioDTMFdetected, DEBOUNCE_TIME); // Debounce the DTMF detected GPIO with a delay of 200ms
-   gpio_export(gpioDTMFdetected, false);          // Causes gpio73 to appear in /sys/class/gpio
-                                            // the bool argument prevents the direction from being changed
-   gpio_request(gpioDTMFdata1, "sysfs");       // Set up the gpioDTMFdata1
-  gpio_direction_input(gpioDTMFdata1);        // Set the DTMF Data 1 GPIO to be an input
-  gpio_set_debounce(gpioDTMFdata1, DEBOUNCE_TIME); // Debounce the DTMF detected GPIO with a delay of 200ms
-   gpio_export(gpioDTMFdata1, false);          // Causes gpio86 to appear in /sys/class/gpio
-                                            // the bool argument prevents the direction from being changed
-   gpio_request(gpioDTMFdata2, "sysfs");       // Set up the gpioDTMFdata2
-  gpio_direction_input(gpioDTMFdata2);        // Set the DTMF Data 2 GPIO to be an input
-  gpio_set_debounce(gpioDTMFdata2, DEBOUNCE_TIME); // Debounce the DTMF detected GPIO with a delay of 200ms
-   gpio_export(gpioDTMFdata2, false);          // Causes gpio75 to appear in /sys/class/gpio
-                                            // the bool argument prevents the direction from being changed
-   // Perform a quick test to see that the button is working as expected on LKM load
-   printk(KERN_INFO "DTMF DETECTED: The DTMF detected GPIO state is currently: %d\n", gpio_get_value(gpioDTMFdetected));
-
-   /// GPIO numbers and IRQ numbers are not the same! This function performs the mapping for us
-   irqNumber = gpio_to_irq(gpioDTMFdetected);
-   printk(KERN_INFO "DTMF DETECTED: The button is mapped to IRQ: %d\n", irqNumber);
-
-   if(!isRising){                           // If the kernel parameter isRising=0 is supplied
-      IRQflags = IRQF_TRIGGER_FALLING;      // Set the interrupt to be on the falling edge
+   if(legacy){
+      result = dtmfrx_add_legacy();
+      if(result) {
+         dtmfrx_del_legacy();
+         platform_driver_unregister(&dtmfrx_driver);
+         debugfs_remove_recursive(dtmfrx_debugfs);
+         kobject_put(dtmfrx_kobj);
+      }
    }
-   // This next call requests an interrupt line
-   result = request_irq(irqNumber,             // The interrupt number requested
-                        (irq_handler_t) dtmfrx_irq_handler, // The pointer to the handler function below
-                        IRQflags,              // Use the custom kernel param to set interrupt type
-                        "dtmfdetected_handler",  // Used in /proc/interrupts to identify the owner
-                        NULL);                 // The *dev_id for shared interrupt lines, NULL is okay
    return result;
 }
 
@@ -291,97 +1707,13 @@ static int __init dtmfrx_init(void){
  *  code is used for a built-in driver (not a LKM) that this function is not required.
  */
 static void __exit dtmfrx_exit(void){
-   printk(KERN_INFO "DTMF DETECTED: The dtmf was detected %d times\n", numberPresses);
-  ledOn = false;
+   dtmfrx_del_legacy();
+   platform_driver_unregister(&dtmfrx_driver);   // dtmfrx_remove() runs for every receiver
+   debugfs_remove_recursive(dtmfrx_debugfs);
    kobject_put(dtmfrx_kobj);                   // clean up -- remove the kobject sysfs entry
-   gpio_set_value(gpioLED, ledOn);              // Turn the LED off, makes it clear the device was unloaded
-   gpio_unexport(gpioLED);                  // Unexport the LED GPIO
-   free_irq(irqNumber, NULL);               // Free the IRQ number, no *dev_id required in this case
-   gpio_unexport(gpioDTMFdetected);               // Unexport the DTMF detected GPIO
-   gpio_free(gpioLED);                      // Free the LED GPIO
-   gpio_free(gpioDTMFdetected);                   // Free the DTMF detected GPIO
    printk(KERN_INFO "DTMF DETECTED: Goodbye from the DTMF DETECTED LKM!\n");
 }
 
-/** @brief The GPIO IRQ Handler function
- *  This function is a custom interrupt handler that is attached to the GPIO above. The same interrupt
- *  handler cannot be invoked concurrently as the interrupt line is masked out until the function is complete.
- *  This function is static as it should not be invoked directly from outside of this file.
- *  @param irq    the IRQ number that is associated with the GPIO -- useful for logging.
- *  @param dev_id the *dev_id that is provided -- can be used to identify which device caused the interrupt
- *  Not used in this example as NULL is passed.
- *  @param regs   h/w specific register values -- only really ever used for debugging.
- *  return returns IRQ_HANDLED if successful -- should return IRQ_NONE otherwise.
- */
-static irq_handler_t dtmfrx_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs){
-   DTMFdata1 = gpio_get_value(gpioDTMFdata1);       ///< DTMF Data 1 received
-   DTMFdata2 = gpio_get_value(gpioDTMFdata2);       ///< DTMF Data 2 received
-   DTMFdata3 = gpio_get_value(gpioDTMFdata3);       ///< DTMF Data 3 received
-   DTMFdata4 = gpio_get_value(gpioDTMFdata4);       ///< DTMF Data 4 received
-   DTMFdigit = (DTMFdata1 << 1) & (DTMFdata1 << 1) & (DTMFdata3 << 3) & (DTMFdata4 << 4);       ///< DTMF Digit received
-   ledOn = true;                      // Invert the LED state on each button press
-   gpio_set_value(gpioLED, ledOn);      // Set the physical LED accordingly
-   getnstimeofday(&ts_current);         // Get the current time as ts_current
-   ts_diff = timespec_sub(ts_current, ts_last);   // Determine the time difference between last 2 presses
-   ts_last = ts_current;                // Store the current time as the last time ts_last
-   printk(KERN_INFO "DTMF DETECTED: The DTMF detected GPIO state is currently: %d\n", gpio_get_value(gpioDTMFdetected));
-   numberPresses++;                     // Global counter, will be outputted when the module is unloaded
-switch(DTMFdigit) {
-   case 1  :
-      *digit=1;
-      break;
-   case 2  :
-      *digit=2;
-      break;
-   case 3  :
-      *digit=3;
-      break;
-   case 4  :
-      *digit=4;
-      break;
-   case 5  :
-      *digit=5;
-      break;
-   case 6  :
-      *digit=6;
-      break;
-   case 7  :
-      *digit=7;
-      break;
-   case 8  :
-      *digit=8;
-      break;
-   case 9  :
-      *digit=9;
-      break;
-   case 10  :
-      *digit=10;
-      break;
-   case 11  :
-      *digit=11; //"*"
-      break;
-   case 12  :
-      *digit=12; //"#"
-      break;
-   case 13  :
-      *digit=13; //"A"
-      break;
-   case 14  :
-      *digit=14; //"B"
-      break;
-   case 15  :
-      *digit=15; //"C"
-      break;
-   case 16  :
-      *digit=16; //"D"
-      break;
-   default :
-      *digit=99; //invalid
-}
-  printk(KERN_INFO "DTMF DIGIT DETECTED: The DTMF digit is : %x\n",  *digit);
-   return (irq_handler_t) IRQ_HANDLED;  // Announce that the IRQ has been handled correctly
-}
-
 // This next calls are  mandatory -- they identify the initialization function
 // and the cleanup function (as above).
 module_init(dtmfrx_init);
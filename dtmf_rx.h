@@ -0,0 +1,158 @@
+/**
+ * @file   dtmf_rx.h
+ * @author CK Lui
+ * @date   Jan 9, 2018
+ * @description
+ * The userspace interface of the MT88L70 DTMF receiver driver. Every decoded tone is queued
+ * as a fixed-size struct dtmf_event record that can be read() from /dev/dtmf0, so that
+ * digits that arrive back to back are never lost between two polls of sysfs. Every open file
+ * reads all the events through its own cursor, so any number of consumers can share a receiver.
+ * The same records are also published in a ring that can be mmap()ed read-only from /dev/dtmfN,
+ * so that a consumer can pick up the digits without any system call at all.
+*/
+#ifndef DTMF_RX_H
+#define DTMF_RX_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define DTMF_EVENT_DIGIT   1     ///< A decoded DTMF tone, digit holds the ASCII key
+#define DTMF_EVENT_SEQUENCE 2    ///< A dialed string collected in sequence mode, see digits[]
+#define DTMF_EVENT_LOST    3     ///< The reader fell behind, lost.count events from seq on were overwritten
+#define DTMF_EVENT_MATCH   4     ///< A registered pattern was dialed, see match
+#define DTMF_SEQ_MAX       16    ///< Maximum number of keys in one sequence record
+
+/** @brief One queued receiver event -- read() always returns a whole number of these
+ *  The timestamp is CLOCK_MONOTONIC in nanoseconds, taken when the tone was detected.
+ *  The seq number increases by one for every event. A reader that falls more than a ring full of
+ *  events behind never holds up the driver or the other readers: it gets a DTMF_EVENT_LOST record
+ *  in place of the events that were overwritten, and carries on with the oldest event still held.
+ *  In sequence mode the digits are collected by the driver and a single DTMF_EVENT_SEQUENCE record
+ *  is queued when the terminator key arrives, a timeout expires or DTMF_SEQ_MAX keys were collected.
+ *  While patterns are registered only DTMF_EVENT_MATCH records are queued, see struct dtmf_patterns.
+ */
+struct dtmf_event {
+   __u64 ts_ns;                  ///< CLOCK_MONOTONIC time of the StD edge in ns (sequence, match: of the first key; lost: when read() noticed)
+   __u32 seq;                    ///< Sequence number of the event (wraps at 2^32)
+   __u8  type;                   ///< DTMF_EVENT_DIGIT, DTMF_EVENT_SEQUENCE, DTMF_EVENT_LOST or DTMF_EVENT_MATCH
+   __u8  digit;                  ///< ASCII key '0'-'9', '*', '#', 'A'-'D' (sequence: the terminator or 0; match: the last key; lost: 0)
+   __u8  nibble;                 ///< Raw Q4..Q1 code read from the MT88L70 (match: of the last key; sequence, lost: 0)
+   __u8  len;                    ///< Number of keys in digits[] (match: of the pattern; digit, lost: 0)
+   union {
+      char  digits[DTMF_SEQ_MAX];   ///< The keys of a sequence, not NUL terminated
+      struct {
+         __u32 count;               ///< Number of events lost, starting at seq
+      } lost;                       ///< DTMF_EVENT_LOST
+      struct {
+         __u64 end_ns;              ///< CLOCK_MONOTONIC time of the last key of the pattern
+         __u32 id;                  ///< The id the pattern was registered with
+      } match;                      ///< DTMF_EVENT_MATCH, ts_ns is the time of its first key
+   };
+};
+
+#define DTMF_RING_VERSION  1     ///< Version of the mmap()ed ring layout below
+
+/** @brief The first page of the mmap()ed ring
+ *  The events follow at data_offset as an array of nr_slots struct dtmf_event, and event seq is
+ *  always written to slot (seq & (nr_slots - 1)). The driver never waits for a consumer: the
+ *  oldest slot is simply overwritten, so every slot works as a small seqlock:
+ *  - the driver sets the slot seq to (seq - 1), writes the record, and then sets the slot seq to
+ *    seq, with a write barrier between each step, before it advances head;
+ *  - a consumer waiting for event seq loads the slot seq (acquire), copies the record, and
+ *    loads the slot seq again after a read barrier. The copy is good if both loads equal seq.
+ *    A slot seq before seq means the event has not been written yet, a slot seq after it means
+ *    the consumer fell more than nr_slots events behind and the event was overwritten.
+ *  The file position of an open /dev/dtmfN is the seq of the next event it wants: read() starts
+ *  there and advances it, and a consumer of the ring that wants to sleep moves it with
+ *  lseek(fd, seq, SEEK_SET). poll() on that file reports POLLIN as soon as head is past it.
+ */
+struct dtmf_ring_header {
+   __u32 version;                ///< DTMF_RING_VERSION
+   __u32 nr_slots;               ///< Number of slots, always a power of 2
+   __u32 slot_size;              ///< sizeof(struct dtmf_event)
+   __u32 data_offset;            ///< Offset of slot 0 from the start of the mapping
+   __u32 head;                   ///< seq of the next event to be written (store-release)
+   __u32 reserved[3];            ///< Always 0
+};
+
+#define DTMF_STATS_VERSION 2     ///< Version of struct dtmf_stats
+
+/// Indexes of dtmf_stats.stat[] -- new counters are only ever added at the end
+#define DTMF_STAT_TONES     0    ///< StD edges that latch a tone (the edge selected by isRising)
+#define DTMF_STAT_DIGITS    1    ///< Tones that were decoded into a key
+#define DTMF_STAT_INVALID   2    ///< Tones whose Q1..Q4 code could not be read
+#define DTMF_STAT_SPURIOUS  3    ///< Interrupts without a change of StD, ignored as glitches
+#define DTMF_STAT_OVERFLOWS 4    ///< Tones dropped because the IRQ thread fell behind
+#define DTMF_STAT_WAKEUPS   5    ///< Times that sleeping readers were woken up
+#define DTMF_STAT_STORMS    6    ///< Switches from interrupt to polling mode because of an IRQ storm
+#define DTMF_STAT_POLLS     7    ///< Samples of StD taken in polling mode
+#define DTMF_STAT_NR        8
+
+/** @brief All the counters of one receiver, returned in one go by DTMF_IOC_GET_STATS
+ *  The counters are 64 bit and count from the last reset (DTMF_IOC_RESET_STATS, or writing 0 to
+ *  the stats sysfs attribute). A program built with an older, smaller struct dtmf_stats still gets
+ *  the counters that fit, and nr_stats tells it how many were filled in.
+ */
+struct dtmf_stats {
+   __u32 version;                ///< DTMF_STATS_VERSION
+   __u32 nr_stats;               ///< Number of valid entries in stat[]
+   __u64 keys[16];               ///< Per key histogram, indexed by the Q4..Q1 code
+   __u64 stat[DTMF_STAT_NR];     ///< The DTMF_STAT_* counters
+};
+
+#define DTMF_PATTERN_MAX   64    ///< Maximum number of patterns registered on one receiver
+
+/** @brief A key string that the driver watches for, see DTMF_IOC_SET_PATTERNS */
+struct dtmf_pattern {
+   __u32 id;                     ///< Reported in the DTMF_EVENT_MATCH record
+   __u8  len;                    ///< Number of keys in keys[], 1 to DTMF_SEQ_MAX
+   __u8  reserved[3];            ///< Must be 0
+   char  keys[DTMF_SEQ_MAX];     ///< ASCII keys '0'-'9', '*', '#', 'A'-'D', not NUL terminated
+};
+
+/** @brief The argument of DTMF_IOC_SET_PATTERNS
+ *  Replaces all the patterns of the receiver. While there are any, the receiver queues only a
+ *  DTMF_EVENT_MATCH record each time the last keys dialed spell one of them (patterns may overlap,
+ *  all the patterns that end at a key are reported), instead of the digits or sequences. A pause
+ *  longer than the inter-digit timeout of sequence mode starts the matching over. A count of 0
+ *  removes all the patterns.
+ */
+struct dtmf_patterns {
+   __u32 count;                  ///< Number of patterns, at most DTMF_PATTERN_MAX
+   __u32 reserved;               ///< Must be 0
+   __u64 patterns;               ///< User pointer to an array of count struct dtmf_pattern
+};
+
+/// DTMF_IOC_RESET_STATS and DTMF_IOC_SET_PATTERNS change the receiver for every reader, so they need
+/// /dev/dtmfN opened for writing (or CAP_SYS_ADMIN) and fail with EPERM otherwise
+#define DTMF_IOC_MAGIC       'D'
+#define DTMF_IOC_GET_STATS   _IOR(DTMF_IOC_MAGIC, 0x40, struct dtmf_stats)   ///< Read all the counters
+#define DTMF_IOC_RESET_STATS _IO(DTMF_IOC_MAGIC, 0x41)                       ///< Reset all the counters
+#define DTMF_IOC_SET_PATTERNS _IOW(DTMF_IOC_MAGIC, 0x42, struct dtmf_patterns) ///< Replace the patterns
+
+#ifndef __KERNEL__
+/** @brief Copies event seq out of the mmap()ed ring following the protocol described above
+ *  @param map the start of the mapping of /dev/dtmfN
+ *  @param seq the sequence number of the event wanted
+ *  @param event receives the event
+ *  @return 1 if the event was copied, 0 if it has not been written yet, -1 if it was overwritten
+ */
+static inline int dtmf_ring_read(const void *map, __u32 seq, struct dtmf_event *event)
+{
+   const struct dtmf_ring_header *hdr = (const struct dtmf_ring_header *)map;
+   const struct dtmf_event *slot = (const struct dtmf_event *)((const char *)map + hdr->data_offset) +
+                                   (seq & (hdr->nr_slots - 1));
+   __u32 before, after;
+
+   before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+   if (before != seq) return (__s32)(before - seq) > 0 ? -1 : 0;
+   *event = *slot;
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+   if (after != seq) return -1;
+   event->seq = seq;
+   return 1;
+}
+#endif /* __KERNEL__ */
+
+#endif /* DTMF_RX_H */
@@ -0,0 +1,127 @@
+/**
+ * @file   dtmf_rx_trace.h
+ * @author CK Lui
+ * @date   Jan 9, 2018
+ * @description
+ * Tracepoints along the capture -> decode -> deliver path of the MT88L70 DTMF receiver driver.
+ * They cost a patched-out branch when disabled. Enable them with e.g.
+ *    echo 1 > /sys/kernel/tracing/events/dtmf_rx/enable
+ * and the difference between the ts_ns of dtmfrx_irq and the time of dtmfrx_dequeue is the
+ * tone-to-userspace latency. The module must be built with -I$(src) so that
+ * trace/define_trace.h can find this file, see CFLAGS_dtmf_rx.o in the Kbuild file.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dtmf_rx
+
+#if !defined(DTMF_RX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define DTMF_RX_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "dtmf_rx.h"
+
+/** @brief The hard IRQ half latched a tone */
+TRACE_EVENT(dtmfrx_irq,
+   TP_PROTO(int id, u8 nibble, u64 ts_ns),
+   TP_ARGS(id, nibble, ts_ns),
+   TP_STRUCT__entry(
+      __field(int, id)
+      __field(u8,  nibble)
+      __field(u64, ts_ns)
+   ),
+   TP_fast_assign(
+      __entry->id = id;
+      __entry->nibble = nibble;
+      __entry->ts_ns = ts_ns;
+   ),
+   TP_printk("dtmf%d nibble=0x%x ts_ns=%llu", __entry->id, __entry->nibble, __entry->ts_ns)
+);
+
+/** @brief The threaded half decoded a tone */
+TRACE_EVENT(dtmfrx_decode,
+   TP_PROTO(int id, u8 nibble, char digit, u64 ts_ns),
+   TP_ARGS(id, nibble, digit, ts_ns),
+   TP_STRUCT__entry(
+      __field(int,  id)
+      __field(u8,   nibble)
+      __field(char, digit)
+      __field(u64,  ts_ns)
+   ),
+   TP_fast_assign(
+      __entry->id = id;
+      __entry->nibble = nibble;
+      __entry->digit = digit;
+      __entry->ts_ns = ts_ns;
+   ),
+   TP_printk("dtmf%d nibble=0x%x digit=%c ts_ns=%llu", __entry->id, __entry->nibble,
+             __entry->digit, __entry->ts_ns)
+);
+
+/** @brief An event was published in the ring for the readers
+ *  depth is the number of events the slowest open file has not read yet, RING_SLOTS once it lost some.
+ */
+TRACE_EVENT(dtmfrx_enqueue,
+   TP_PROTO(int id, const struct dtmf_event *event, unsigned int depth),
+   TP_ARGS(id, event, depth),
+   TP_STRUCT__entry(
+      __field(int, id)
+      __field(u32, seq)
+      __field(u8,  type)
+      __field(u8,  digit)
+      __field(u8,  len)
+      __field(u64, ts_ns)
+      __field(unsigned int, depth)
+   ),
+   TP_fast_assign(
+      __entry->id = id;
+      __entry->seq = event->seq;
+      __entry->type = event->type;
+      __entry->digit = event->digit;
+      __entry->len = event->len;
+      __entry->ts_ns = event->ts_ns;
+      __entry->depth = depth;
+   ),
+   TP_printk("dtmf%d seq=%u type=%u digit=0x%x len=%u ts_ns=%llu depth=%u", __entry->id,
+             __entry->seq, __entry->type, __entry->digit, __entry->len, __entry->ts_ns, __entry->depth)
+);
+
+/** @brief Readers sleeping in read() or poll() were woken up */
+TRACE_EVENT(dtmfrx_wakeup,
+   TP_PROTO(int id),
+   TP_ARGS(id),
+   TP_STRUCT__entry(
+      __field(int, id)
+   ),
+   TP_fast_assign(
+      __entry->id = id;
+   ),
+   TP_printk("dtmf%d", __entry->id)
+);
+
+/** @brief read() handed count events to userspace, starting with event seq captured at ts_ns */
+TRACE_EVENT(dtmfrx_dequeue,
+   TP_PROTO(int id, u32 seq, u64 ts_ns, unsigned int count),
+   TP_ARGS(id, seq, ts_ns, count),
+   TP_STRUCT__entry(
+      __field(int, id)
+      __field(u32, seq)
+      __field(u64, ts_ns)
+      __field(unsigned int, count)
+   ),
+   TP_fast_assign(
+      __entry->id = id;
+      __entry->seq = seq;
+      __entry->ts_ns = ts_ns;
+      __entry->count = count;
+   ),
+   TP_printk("dtmf%d seq=%u ts_ns=%llu count=%u", __entry->id, __entry->seq, __entry->ts_ns,
+             __entry->count)
+);
+
+#endif /* DTMF_RX_TRACE_H */
+
+/// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dtmf_rx_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,85 @@
+#!/bin/sh
+# @file   dtmf_gpiosim.sh
+# @author CK Lui
+# @date   Jan 9, 2018
+# @description
+# Runs the DTMF receiver driver on an ordinary Linux box: creates a gpio-sim chip with the lines of
+# one MT88L70 (StD, Q1..Q4, PD and the LED), loads dtmf_rx.ko on it through the gpio* module
+# parameters and runs dtmf_replay -g, which drives StD and Q1..Q4 through the pull attributes of
+# the chip at a controlled rate and reads the events back from /dev/dtmfN. Everything is removed
+# again on the way out. Needs root, configfs and a kernel with CONFIG_GPIO_SIM.
+#
+#   sudo ./dtmf_gpiosim.sh -r 20 -n 500        500 keys at 20 keys/s
+#   sudo ./dtmf_gpiosim.sh -R -r 50 -n 2000    the highest rate the driver sustains
+#   sudo DEBOUNCE=0 ./dtmf_gpiosim.sh -R       ... with the glitch filter off
+#
+# The options are those of dtmf_replay, except -g, -d and -D. Set the glitch filter window with
+# DEBOUNCE (in us, 2000 by default) and the module with MODULE (../dtmf_rx.ko by default).
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+MODULE=${MODULE:-$HERE/../dtmf_rx.ko}
+DEBOUNCE=${DEBOUNCE:-2000}
+SIM=/sys/kernel/config/gpio-sim/dtmf-rx-sim
+LABEL=dtmf-rx-sim
+LOADED=
+
+cleanup() {
+   set +e
+   [ -n "$LOADED" ] && rmmod dtmf_rx
+   if [ -d "$SIM" ]; then
+      echo 0 > "$SIM/live"
+      for line in "$SIM"/bank0/line*; do rmdir "$line"; done
+      rmdir "$SIM/bank0" "$SIM"
+   fi
+}
+
+die() {
+   echo "dtmf_gpiosim: $*" >&2
+   exit 1
+}
+
+[ -x "$HERE/dtmf_replay" ] || die "build dtmf_replay first (make -C $HERE)"
+[ -f "$MODULE" ] || die "build the module first (make -C $HERE/..)"
+grep -q '^dtmf_rx ' /proc/modules && die "dtmf_rx is already loaded"
+trap cleanup EXIT INT TERM
+
+modprobe gpio-sim
+grep -q ' /sys/kernel/config ' /proc/mounts || mount -t configfs none /sys/kernel/config
+
+# One bank of 7 lines: StD, Q1..Q4 are inputs of the driver, PD and the LED are its outputs
+mkdir "$SIM" "$SIM/bank0"
+echo 7 > "$SIM/bank0/num_lines"
+echo "$LABEL" > "$SIM/bank0/label"
+i=0
+for name in StD Q1 Q2 Q3 Q4 PD LED; do
+   mkdir "$SIM/bank0/line$i"
+   echo "$name" > "$SIM/bank0/line$i/name"
+   i=$((i + 1))
+done
+echo 1 > "$SIM/live"
+CHIP=/sys/devices/platform/$(cat "$SIM/dev_name")/$(cat "$SIM/bank0/chip_name")
+
+# The module parameters take global GPIO numbers, so find the base of the chip
+BASE=
+for chip in /sys/class/gpio/gpiochip*; do
+   [ "$(cat "$chip/label" 2>/dev/null)" = "$LABEL" ] && BASE=$(cat "$chip/base")
+done
+if [ -z "$BASE" ] && [ -r /sys/kernel/debug/gpio ]; then
+   BASE=$(sed -n "s/^gpiochip[0-9]*: GPIOs \([0-9]*\)-.*, $LABEL:.*/\1/p" /sys/kernel/debug/gpio)
+fi
+[ -n "$BASE" ] || die "cannot find the GPIO base of $LABEL, needs CONFIG_GPIO_SYSFS or debugfs"
+
+insmod "$MODULE" useInput=0 gpioDTMFdetected=$BASE gpioDTMFdata1=$((BASE + 1)) \
+   gpioDTMFdata2=$((BASE + 2)) gpioDTMFdata3=$((BASE + 3)) gpioDTMFdata4=$((BASE + 4)) \
+   gpioDTMFpd=$((BASE + 5)) gpioLED=$((BASE + 6))
+LOADED=1
+RX=/sys/dtmf/gpio$BASE
+[ -d "$RX/misc" ] || die "the receiver on gpio$BASE did not come up, see dmesg"
+DEV=/dev/$(ls "$RX/misc")
+echo "$DEBOUNCE" > "$RX/debounceTime"
+echo "dtmf_gpiosim: $DEV on $CHIP, glitch filter ${DEBOUNCE} us"
+
+"$HERE/dtmf_replay" -g "$CHIP" -d "$DEV" -D "$DEBOUNCE" "$@"
+echo "dtmf_gpiosim: driver counters"
+cat "$RX/stats"
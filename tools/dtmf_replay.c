@@ -0,0 +1,855 @@
+/**
+ * @file   dtmf_replay.c
+ * @author CK Lui
+ * @date   Jan 9, 2018
+ * @description
+ * A userspace test and benchmark of the MT88L70 DTMF receiver that needs no Beaglebone and no
+ * tone generator. It generates StD/Q1..Q4 traffic at a given rate (or reads a recorded trace) and
+ *  - replays it through dtmf_core.h, the same edge classifier, sequence assembler, pattern matcher,
+ *    event ring and IRQ rate window that the module is built from, with the timing of the glitch
+ *    filter and of the sequence timeouts, and a consumer thread reads the events back from the
+ *    ring with dtmf_ring_read(); or
+ *  - with -g, writes it to the pull attributes of a gpio-sim chip wired to a receiver and read()s
+ *    the events from its /dev/dtmfN, see dtmf_gpiosim.sh.
+ * Either way it reports the digits/s that got through, the events dropped on the way and the
+ * latency from the StD edge to the reader. With -R the rate is raised until digits are lost or the
+ * traffic can no longer be kept up, and the highest rate that went through cleanly is reported.
+ * -t checks the core against known answers and is run by make check.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include "dtmf_core.h"        // The decode and event state machines of the module
+#define  NSEC_PER_USEC 1000ULL
+#define  NSEC_PER_SEC  1000000000ULL
+#define  RING_SLOTS 128       ///< The ring of the module, PAGE_SIZE / sizeof(struct dtmf_event)
+#define  RING_PAGE 4096       ///< The header page of the ring
+#define  STORM_WINDOWS 10     ///< The IRQ rate is measured over windows of 1/10 s, as in the module
+#define  SIM_STD 0            ///< gpio-sim line of StD, Q1..Q4 follow at 1..4
+#define  MAX_KEYS 256         ///< Maximum length of the key string given with -k
+#define  RESYNC_KEYS 64       ///< How far ahead a key that arrived is looked for in the traffic
+
+/** @brief One StD edge of the traffic */
+struct edge {
+   __u64 ts_ns;                  ///< Time of the edge from the start of the traffic
+   __u8  level;                  ///< The StD level after the edge
+   __u8  nibble;                 ///< The Q4..Q1 code on the data lines at the edge
+};
+
+/** @brief The command line */
+struct options {
+   unsigned long count;          ///< -n Keys dialed per run
+   unsigned int rate;            ///< -r Keys per second, 0 replays as fast as possible
+   bool ramp;                    ///< -R Raise the rate until the traffic does not get through
+   unsigned int duty;            ///< -u Percent of the key period that the tone lasts
+   unsigned int debounceUs;      ///< -D Window of the glitch filter, 0 turns it off
+   unsigned int glitchUs;        ///< -G A StD pulse this long in every pause, 0 for none
+   unsigned int stormThreshold;  ///< -x IRQs per second counted as a storm
+   const char *keys;             ///< -k The keys dialed, over and over
+   bool isSequence;              ///< -s Collect the keys into sequences
+   char seqTerminator;           ///< -e Key that completes a sequence at once, 0 for none
+   unsigned int seqTimeoutUs;    ///< -S Inter-digit timeout of sequence mode and of the matcher
+   unsigned int seqMaxTimeUs;    ///< -M Completion timeout of sequence mode from the first key, 0 for none
+   const char *patterns;         ///< -p Comma separated patterns to match
+   unsigned int consumerUs;      ///< -c Time the consumer spends on every event
+   const char *file;             ///< -f Replay this recorded trace instead
+   const char *simDir;           ///< -g The gpiochip directory of a gpio-sim chip
+   const char *device;           ///< -d The /dev/dtmfN wired to it
+};
+
+/** @brief What one run measured */
+struct result {
+   unsigned long sent;           ///< Keys in the traffic
+   unsigned long received;       ///< Keys that arrived, as digits or in sequences
+   unsigned long matches;        ///< DTMF_EVENT_MATCH records that arrived
+   unsigned long lost;           ///< Events the consumer was told were overwritten
+   unsigned long missed;         ///< Keys that never arrived
+   unsigned long mismatched;     ///< Keys that arrived but were not dialed
+   unsigned long spurious;       ///< StD edges dropped as glitches
+   unsigned long storms;         ///< Windows above the storm threshold
+   unsigned long overflows;      ///< Tones the driver dropped (-g only)
+   double seconds;               ///< Time the traffic took to send
+   __u64 *latency;               ///< StD edge to the reader in ns, of every digit and match
+   size_t nr_latency;
+};
+
+/** @brief The consumer side of a run -- checks the keys against the traffic, in order */
+struct consumer {
+   const char *keys;             ///< Every key of the traffic
+   size_t next;                  ///< Index of the key expected next
+   __u64 start_ns;               ///< CLOCK_MONOTONIC of time 0 of the traffic
+   size_t max_latency;
+   struct result *result;
+};
+
+/** @brief The core of one receiver as the module runs it, with the ring in plain memory */
+struct replay {
+   const struct options *opts;
+   struct dtmf_ring_header *ring;
+   struct dtmf_event *slots;
+   __u32 eventSeq;
+   __u8 stdLevel;
+   struct dtmf_core_rate storm;
+   struct dtmf_core_seq sequence;
+   __u64 seqExpires;             ///< When the sequence being collected times out, 0 for none
+   struct dtmf_core_ac_state *states;  ///< The pattern matcher, NULL for none
+   struct dtmf_pattern patterns[DTMF_PATTERN_MAX];
+   unsigned int nr_patterns;
+   struct dtmf_core_match match;
+   __u64 lastKey;
+   bool paced;                   ///< Every edge waits for its time
+   __u64 start_ns;
+   struct result *result;
+   int done;                     ///< The traffic is over, set with release
+};
+
+/** @brief CLOCK_MONOTONIC in ns, the clock of the driver timestamps */
+static __u64 now_ns(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/** @brief Sleeps until a CLOCK_MONOTONIC time in ns */
+static void sleep_until(__u64 ns){
+   struct timespec ts = { .tv_sec = ns / NSEC_PER_SEC, .tv_nsec = ns % NSEC_PER_SEC };
+   while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/** @brief Generates the traffic: every key is a tone of duty percent of the period, then a pause
+ *  @param period_ns the time from one key to the next -- at rate 0 the traffic still has a
+ *  timeline for the glitch filter and the timeouts, it is just not waited for
+ *  @return the number of edges, or 0 if out of memory
+ */
+static size_t traffic_generate(const struct options *opts, __u64 period_ns, struct edge **edges){
+   size_t nr_keys = strlen(opts->keys), n = 0;
+   __u64 tone_ns = period_ns * opts->duty / 100, glitch_ns = opts->glitchUs * NSEC_PER_USEC, t;
+   unsigned long i;
+   __u8 nibble;
+
+   *edges = malloc(opts->count * 4 * sizeof(**edges));
+   if(!*edges) return 0;
+   for(i = 0; i < opts->count; i++){
+      t = i * period_ns;
+      nibble = dtmf_core_nibble(opts->keys[i % nr_keys]);
+      (*edges)[n++] = (struct edge){ t, 1, nibble };
+      (*edges)[n++] = (struct edge){ t + tone_ns, 0, nibble };
+      if(glitch_ns){                              // In the middle of the pause
+         t += tone_ns + (period_ns - tone_ns) / 2;
+         (*edges)[n++] = (struct edge){ t, 1, nibble };
+         (*edges)[n++] = (struct edge){ t + glitch_ns, 0, nibble };
+      }
+   }
+   return n;
+}
+
+/** @brief Reads a recorded trace, one edge per line: the time in ns, the StD level and the Q4..Q1
+ *  code in hex, e.g. "1200000 1 a". Lines starting with # are comments.
+ *  @return the number of edges, or 0 if the file could not be read
+ */
+static size_t traffic_read(const char *file, struct edge **edges){
+   size_t n = 0, size = 1024;
+   unsigned long long ts;
+   unsigned int level, nibble;
+   char line[128];
+   FILE *fp = fopen(file, "r");
+
+   if(!fp) return 0;
+   *edges = malloc(size * sizeof(**edges));
+   while(*edges && fgets(line, sizeof(line), fp)){
+      if(line[0] == '#' || sscanf(line, "%llu %u %x", &ts, &level, &nibble) != 3) continue;
+      if(n == size) *edges = realloc(*edges, (size *= 2) * sizeof(**edges));
+      if(*edges) (*edges)[n++] = (struct edge){ ts, level != 0, nibble & 0x0f };
+   }
+   fclose(fp);
+   return *edges ? n : 0;
+}
+
+/** @brief The keys dialed in the traffic, to check the events against
+ *  A key is a rising StD edge that the glitch filter lets through.
+ *  @return the keys, or NULL if out of memory
+ */
+static char *traffic_keys(const struct options *opts, const struct edge *edges, size_t n, unsigned long *count){
+   __u64 debounce_ns = opts->debounceUs * NSEC_PER_USEC;
+   char *keys = malloc(n + 1);
+   size_t i;
+
+   for(*count = 0, i = 0; keys && i < n; i++){
+      if(!edges[i].level || (i + 1 < n && edges[i + 1].ts_ns - edges[i].ts_ns < debounce_ns)) continue;
+      keys[(*count)++] = dtmf_core_key(edges[i].nibble);
+   }
+   return keys;
+}
+
+/** @brief Checks one key that arrived against the traffic
+ *  A key that does not come next is looked for a little further on, and the keys skipped are
+ *  counted as missed.
+ */
+static void consumer_key(struct consumer *c, char key){
+   size_t k;
+
+   for(k = 0; k < RESYNC_KEYS && c->next + k < c->result->sent && c->keys[c->next + k] != key; k++);
+   if(k == RESYNC_KEYS || c->next + k == c->result->sent){
+      c->result->mismatched++;
+      return;
+   }
+   c->result->missed += k;
+   c->next += k + 1;
+   c->result->received++;
+}
+
+/** @brief Accounts for one event that arrived
+ *  @param ts_ns the time of the StD edge the latency is measured from, 0 for none
+ */
+static void consumer_event(struct consumer *c, const struct dtmf_event *event, __u64 ts_ns){
+   struct result *r = c->result;
+   unsigned int i;
+
+   switch(event->type){
+   case DTMF_EVENT_DIGIT:
+      consumer_key(c, event->digit);
+      break;
+   case DTMF_EVENT_SEQUENCE:                     // No latency, it counts from the first key
+      for(i = 0; i < event->len; i++) consumer_key(c, event->digits[i]);
+      if(event->digit) consumer_key(c, event->digit);
+      ts_ns = 0;
+      break;
+   case DTMF_EVENT_LOST:
+      r->lost += event->lost.count;
+      ts_ns = 0;
+      break;
+   case DTMF_EVENT_MATCH:
+      r->matches++;
+      break;
+   }
+   if(ts_ns && r->nr_latency < c->max_latency) r->latency[r->nr_latency++] = now_ns() - ts_ns;
+}
+
+/** @brief The keys at the end of the traffic that never arrived */
+static void consumer_finish(struct consumer *c){
+   if(c->result->sent > c->next) c->result->missed += c->result->sent - c->next;
+}
+
+/** @brief Publishes an event in the ring, dtmfrx_emit() */
+static void replay_emit(struct replay *rp, struct dtmf_event *event){
+   event->seq = rp->eventSeq++;
+   dtmf_core_ring_put(rp->ring, rp->slots, RING_SLOTS, event);
+}
+
+/** @brief Waits for a time of the traffic, if the replay is paced */
+static void replay_at(struct replay *rp, __u64 ts_ns){
+   if(rp->paced) sleep_until(rp->start_ns + ts_ns);
+}
+
+/** @brief Queues the sequence being collected, dtmfrx_seq_flush() */
+static void replay_seq_flush(struct replay *rp, char terminator){
+   struct dtmf_event event;
+
+   if(dtmf_core_seq_flush(&rp->sequence, terminator, &event)) replay_emit(rp, &event);
+   rp->seqExpires = 0;
+}
+
+/** @brief Runs seq_timer if it expires by ts_ns */
+static void replay_advance(struct replay *rp, __u64 ts_ns){
+   if(rp->seqExpires && rp->seqExpires <= ts_ns){
+      replay_at(rp, rp->seqExpires);
+      replay_seq_flush(rp, 0);
+   }
+}
+
+/** @brief Matches a key, dtmfrx_match() */
+static void replay_match(struct replay *rp, __u64 ts_ns, __u8 nibble){
+   const struct dtmf_pattern *pattern;
+   struct dtmf_event event;
+   __u16 state;
+
+   if(ts_ns - rp->lastKey > rp->opts->seqTimeoutUs * NSEC_PER_USEC) rp->match.state = 0;
+   rp->lastKey = ts_ns;
+   state = dtmf_core_match_key(&rp->match, rp->states, ts_ns, nibble);
+   for(; state; state = rp->states[state].dict){
+      pattern = &rp->patterns[rp->states[state].pattern];
+      dtmf_core_match_event(&rp->match, pattern->len, pattern->id, &event);
+      replay_emit(rp, &event);
+   }
+}
+
+/** @brief Takes an StD level as an edge, dtmfrx_latch() and the threaded half of the module */
+static void replay_latch(struct replay *rp, __u64 ts_ns, __u8 level, __u8 nibble){
+   const struct options *opts = rp->opts;
+   struct dtmf_event event;
+   int edge = dtmf_core_edge(&rp->stdLevel, level, 1);
+
+   if(edge == DTMF_CORE_GLITCH) rp->result->spurious++;
+   if(edge != DTMF_CORE_TONE) return;
+   if(rp->states){
+      replay_match(rp, ts_ns, nibble);
+      return;
+   }
+   if(opts->isSequence){
+      if(dtmf_core_seq_add(&rp->sequence, ts_ns, dtmf_core_key(nibble), opts->seqTerminator, &event)){
+         replay_emit(rp, &event);
+         rp->seqExpires = 0;
+      }
+      else
+         rp->seqExpires = dtmf_core_seq_expires(&rp->sequence, ts_ns, opts->seqTimeoutUs, opts->seqMaxTimeUs);
+      return;
+   }
+   memset(&event, 0, sizeof(event));
+   event.type = DTMF_EVENT_DIGIT;
+   event.ts_ns = ts_ns;
+   event.digit = dtmf_core_key(nibble);
+   event.nibble = nibble;
+   replay_emit(rp, &event);
+}
+
+/** @brief Replays the traffic through the core
+ *  With the glitch filter on, an edge is only taken once StD did not move for debounceUs, at the
+ *  time of the first edge of the burst, as dtmfrx_debounce_timeout() does.
+ */
+static void replay_traffic(struct replay *rp, const struct edge *edges, size_t n){
+   __u64 debounce_ns = rp->opts->debounceUs * NSEC_PER_USEC, burst_ns = 0;
+   __u64 window_ns = NSEC_PER_SEC / STORM_WINDOWS;
+   long limit = (rp->opts->stormThreshold + STORM_WINDOWS - 1) / STORM_WINDOWS, ended;
+   bool burst = false;
+   size_t i;
+
+   for(i = 0; i < n; i++){
+      ended = dtmf_core_rate_count(&rp->storm, edges[i].ts_ns, window_ns, 1);
+      if(rp->opts->stormThreshold && ended > limit) rp->result->storms++;
+      if(!debounce_ns){
+         replay_advance(rp, edges[i].ts_ns);
+         replay_at(rp, edges[i].ts_ns);
+         replay_latch(rp, edges[i].ts_ns, edges[i].level, edges[i].nibble);
+         continue;
+      }
+      if(!burst) burst_ns = edges[i].ts_ns;
+      burst = true;
+      if(i + 1 < n && edges[i + 1].ts_ns - edges[i].ts_ns < debounce_ns) continue;   // Restarts the filter
+      replay_advance(rp, edges[i].ts_ns + debounce_ns);
+      replay_at(rp, edges[i].ts_ns + debounce_ns);
+      replay_latch(rp, burst_ns, edges[i].level, edges[i].nibble);
+      burst = false;
+   }
+   replay_advance(rp, (__u64)-1);                // The last sequence times out
+}
+
+/** @brief Sets up the core and an empty ring, as dtmfrx_probe() and dtmfrx_ring_init() do
+ *  @return 0 if successful, -1 if out of memory or the patterns are not valid
+ */
+static int replay_init(struct replay *rp, const struct options *opts, struct result *result){
+   char copy[1024], *key, *save;
+   unsigned int i;
+   __u16 *scratch;
+   int size;
+
+   memset(rp, 0, sizeof(*rp));
+   rp->opts = opts;
+   rp->result = result;
+   rp->ring = aligned_alloc(RING_PAGE, RING_PAGE + RING_SLOTS * sizeof(struct dtmf_event));
+   if(!rp->ring) return -1;
+   memset(rp->ring, 0, RING_PAGE);
+   rp->slots = (struct dtmf_event *)((char *)rp->ring + RING_PAGE);
+   rp->ring->version = DTMF_RING_VERSION;
+   rp->ring->nr_slots = RING_SLOTS;
+   rp->ring->slot_size = sizeof(struct dtmf_event);
+   rp->ring->data_offset = RING_PAGE;
+   for(i = 0; i < RING_SLOTS; i++) rp->slots[i].seq = i - RING_SLOTS;
+   if(!opts->patterns) return 0;
+   snprintf(copy, sizeof(copy), "%s", opts->patterns);
+   for(key = strtok_r(copy, ",", &save); key && rp->nr_patterns < DTMF_PATTERN_MAX; key = strtok_r(NULL, ",", &save)){
+      rp->patterns[rp->nr_patterns].id = rp->nr_patterns;
+      rp->patterns[rp->nr_patterns].len = strnlen(key, DTMF_SEQ_MAX + 1);
+      strncpy(rp->patterns[rp->nr_patterns].keys, key, DTMF_SEQ_MAX);
+      rp->nr_patterns++;
+   }
+   size = dtmf_core_ac_size(rp->patterns, rp->nr_patterns);
+   if(size < 0) return -1;
+   rp->states = calloc(size, sizeof(*rp->states));
+   scratch = calloc(2 * size, sizeof(*scratch));
+   if(rp->states && scratch) dtmf_core_ac_build(rp->states, rp->patterns, rp->nr_patterns, scratch);
+   free(scratch);
+   return rp->states ? 0 : -1;
+}
+
+static void replay_free(struct replay *rp){
+   free(rp->states);
+   free(rp->ring);
+}
+
+/** @brief Reads the ring from a cursor up to the head like a consumer of the mmap()ed ring
+ *  An overwritten event is reported as one DTMF_EVENT_LOST, the same way read() does.
+ *  @return the new cursor
+ */
+static __u32 replay_consume(struct replay *rp, struct consumer *c, __u32 cursor){
+   struct dtmf_event event;
+   __u32 head;
+   int result;
+
+   while(cursor != (head = __atomic_load_n(&rp->ring->head, __ATOMIC_ACQUIRE))){
+      result = dtmf_ring_read(rp->ring, cursor, &event);
+      if(result == 0) break;
+      if(result < 0) dtmf_core_ring_lost(head, RING_SLOTS, cursor, now_ns() - c->start_ns, &event);
+      consumer_event(c, &event, event.type == DTMF_EVENT_MATCH ? c->start_ns + event.match.end_ns :
+                                event.type == DTMF_EVENT_DIGIT ? c->start_ns + event.ts_ns : 0);
+      cursor += dtmf_core_ring_skip(&event);
+      if(rp->opts->consumerUs) usleep(rp->opts->consumerUs);
+   }
+   return cursor;
+}
+
+/** @brief What the consumer thread of a replay reads, and where it accounts for it */
+struct replay_reader {
+   struct replay *rp;
+   struct consumer *c;
+};
+
+/** @brief The consumer thread of a replay -- polls the ring until the traffic is over and it is empty */
+static void *replay_read_thread(void *data){
+   struct replay_reader *reader = data;
+   __u32 cursor = 0;
+   int done;
+
+   for(;;){
+      done = __atomic_load_n(&reader->rp->done, __ATOMIC_ACQUIRE);
+      cursor = replay_consume(reader->rp, reader->c, cursor);
+      if(done && cursor == __atomic_load_n(&reader->rp->ring->head, __ATOMIC_ACQUIRE)) break;
+      sched_yield();
+   }
+   return NULL;
+}
+
+/** @brief Replays the traffic through the core with a consumer thread */
+static int run_replay(const struct options *opts, const struct edge *edges, size_t n, struct consumer *c){
+   struct replay rp;
+   struct replay_reader reader = { &rp, c };
+   pthread_t thread;
+   __u64 begin;
+
+   if(replay_init(&rp, opts, c->result)){
+      fprintf(stderr, "dtmf_replay: out of memory or invalid patterns\n");
+      replay_free(&rp);
+      return -1;
+   }
+   rp.paced = opts->rate != 0;
+   rp.start_ns = c->start_ns = now_ns() + 10000000;   // Give the consumer time to start
+   if(pthread_create(&thread, NULL, replay_read_thread, &reader)){
+      replay_free(&rp);
+      return -1;
+   }
+   sleep_until(rp.start_ns);
+   begin = now_ns();
+   replay_traffic(&rp, edges, n);
+   c->result->seconds = (now_ns() - begin) / 1e9;
+   __atomic_store_n(&rp.done, 1, __ATOMIC_RELEASE);
+   pthread_join(thread, NULL);
+   consumer_finish(c);
+   replay_free(&rp);
+   return 0;
+}
+
+/** @brief The lines of the gpio-sim chip and the receiver wired to them */
+struct sim {
+   int pull[1 + 4];              ///< The pull attributes of StD, then Q1..Q4
+   int dev;                      ///< /dev/dtmfN
+   struct consumer *c;
+   int done;                     ///< The traffic is over, set with release
+};
+
+/** @brief Drives one gpio-sim line */
+static int sim_set(struct sim *sim, int line, int level){
+   static const char *pulls[2] = { "pull-down", "pull-up" };
+   return pwrite(sim->pull[line], pulls[level], strlen(pulls[level]), 0) < 0 ? -1 : 0;
+}
+
+/** @brief Reads the events from /dev/dtmfN until the traffic is over and the driver is quiet for a second */
+static void *sim_reader(void *data){
+   struct sim *sim = data;
+   struct dtmf_event events[64];
+   struct pollfd pfd = { .fd = sim->dev, .events = POLLIN };
+   __u64 idle = 0;
+   ssize_t len;
+   int i;
+
+   for(;;){
+      if(poll(&pfd, 1, 100) > 0 && (len = read(sim->dev, events, sizeof(events))) > 0){
+         for(i = 0; i < len / (ssize_t)sizeof(events[0]); i++)
+            consumer_event(sim->c, &events[i], events[i].type == DTMF_EVENT_MATCH ? events[i].match.end_ns :
+                                               events[i].type == DTMF_EVENT_DIGIT ? events[i].ts_ns : 0);
+         idle = 0;
+         continue;
+      }
+      if(!__atomic_load_n(&sim->done, __ATOMIC_ACQUIRE)) continue;
+      if(sim->c->next >= sim->c->result->sent) break;
+      if(!idle) idle = now_ns();
+      else if(now_ns() - idle > NSEC_PER_SEC) break;
+   }
+   return NULL;
+}
+
+/** @brief Drives the traffic into a receiver through gpio-sim and reads back its events
+ *  The data lines are set before the StD edge that latches the tone, as the MT88L70 does.
+ */
+static int run_sim(const struct options *opts, const struct edge *edges, size_t n, struct consumer *c){
+   struct sim sim = { .c = c };
+   struct dtmf_stats before, after;
+   pthread_t thread;
+   char path[512];
+   int i, result = -1, nibble = -1;
+   size_t e;
+
+   for(i = 0; i < 5; i++) sim.pull[i] = -1;
+   sim.dev = open(opts->device, O_RDONLY | O_NONBLOCK);
+   if(sim.dev < 0){
+      perror(opts->device);
+      return -1;
+   }
+   for(i = 0; i < 5; i++){
+      snprintf(path, sizeof(path), "%s/sim_gpio%d/pull", opts->simDir, SIM_STD + i);
+      sim.pull[i] = open(path, O_WRONLY);
+      if(sim.pull[i] < 0){
+         perror(path);
+         goto out;
+      }
+   }
+   if(sim_set(&sim, SIM_STD, 0)) goto out;
+   usleep(opts->debounceUs + 10000);             // Let the receiver settle with StD low
+   if(ioctl(sim.dev, DTMF_IOC_GET_STATS, &before)) goto out;
+   lseek(sim.dev, 0, SEEK_END);                  // Skip the events of the settling
+   if(pthread_create(&thread, NULL, sim_reader, &sim)) goto out;
+   c->start_ns = now_ns() + 10000000;
+   sleep_until(c->start_ns);
+   for(e = 0; e < n; e++){
+      if(opts->rate) sleep_until(c->start_ns + edges[e].ts_ns);
+      if(edges[e].level && edges[e].nibble != nibble){
+         nibble = edges[e].nibble;
+         for(i = 0; i < 4; i++) sim_set(&sim, 1 + i, (nibble >> i) & 1);
+      }
+      if(sim_set(&sim, SIM_STD, edges[e].level)) break;
+   }
+   c->result->seconds = (now_ns() - c->start_ns) / 1e9;
+   __atomic_store_n(&sim.done, 1, __ATOMIC_RELEASE);
+   pthread_join(thread, NULL);
+   consumer_finish(c);
+   if(!ioctl(sim.dev, DTMF_IOC_GET_STATS, &after)){
+      c->result->spurious = after.stat[DTMF_STAT_SPURIOUS] - before.stat[DTMF_STAT_SPURIOUS];
+      c->result->storms = after.stat[DTMF_STAT_STORMS] - before.stat[DTMF_STAT_STORMS];
+      c->result->overflows = after.stat[DTMF_STAT_OVERFLOWS] - before.stat[DTMF_STAT_OVERFLOWS] +
+                             after.stat[DTMF_STAT_INVALID] - before.stat[DTMF_STAT_INVALID];
+   }
+   result = e == n ? 0 : -1;
+out:
+   for(i = 0; i < 5; i++) if(sim.pull[i] >= 0) close(sim.pull[i]);
+   close(sim.dev);
+   return result;
+}
+
+static int compare_u64(const void *a, const void *b){
+   __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+   return x < y ? -1 : x > y;
+}
+
+/** @brief The latency below which a fraction of the samples fall, in us */
+static double percentile(const struct result *r, double fraction){
+   size_t i = (size_t)(fraction * (r->nr_latency - 1) + 0.5);
+   return r->latency[i] / 1e3;
+}
+
+/** @brief Prints a run, one line of counts and one of latency percentiles */
+static void result_print(const struct options *opts, unsigned int rate, struct result *r){
+   if(rate) printf("%7u/s: ", rate);
+   else printf("unpaced: ");
+   printf("%lu keys in %.3f s (%.1f/s), received %lu, matches %lu, lost %lu, missed %lu, "
+          "mismatched %lu, spurious %lu, storms %lu", r->sent, r->seconds,
+          r->seconds > 0 ? r->sent / r->seconds : 0, r->received, r->matches, r->lost, r->missed,
+          r->mismatched, r->spurious, r->storms);
+   if(opts->simDir) printf(", dropped by the driver %lu", r->overflows);
+   printf("\n");
+   if(!rate || !r->nr_latency) return;           // Unpaced, the latency is only the backlog
+   qsort(r->latency, r->nr_latency, sizeof(r->latency[0]), compare_u64);
+   printf("          latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+          percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), percentile(r, 0.999),
+          percentile(r, 1.0));
+}
+
+/** @brief Sends the traffic once at a rate
+ *  @return 1 if every key got through and the rate was kept up, 0 if not, -1 on an error
+ */
+static int run(const struct options *defaults, unsigned int rate, __u64 *latency){
+   struct options opts = *defaults;
+   struct result r = { .latency = latency };
+   struct consumer c = { .max_latency = opts.count * 2, .result = &r };
+   struct edge *edges = NULL;
+   char *keys;
+   size_t n;
+   int result;
+
+   opts.rate = rate;
+   if(opts.file) n = traffic_read(opts.file, &edges);
+   else n = traffic_generate(&opts, rate ? NSEC_PER_SEC / rate : 50000000, &edges);
+   keys = n ? traffic_keys(&opts, edges, n, &r.sent) : NULL;
+   if(!keys){
+      fprintf(stderr, "dtmf_replay: no traffic\n");
+      free(edges);
+      return -1;
+   }
+   c.keys = keys;
+   result = opts.simDir ? run_sim(&opts, edges, n, &c) : run_replay(&opts, edges, n, &c);
+   free(edges);
+   free(keys);
+   if(result) return -1;
+   if(opts.patterns) r.missed = r.mismatched = 0;   // Only the matches are queued
+   result_print(&opts, rate, &r);
+   return !r.lost && !r.missed && !r.mismatched && !r.overflows &&
+          (!rate || opts.file || r.seconds <= 1.05 * r.sent / rate);   // The traffic was sent in time
+}
+
+/** @brief Finds the highest rate the traffic gets through at: doubles the rate until a run fails,
+ *  then halves the interval between the last good and the first bad rate a few times
+ */
+static int ramp(const struct options *opts, __u64 *latency){
+   unsigned int good = 0, bad = 0, rate = opts->rate ? opts->rate : 10, i;
+   int result;
+
+   while(!bad){
+      result = run(opts, rate, latency);
+      if(result < 0) return 1;
+      if(result) good = rate;
+      else bad = rate;
+      if(rate > 1000000) break;
+      rate *= 2;
+   }
+   for(i = 0; bad && i < 5 && bad - good > 1; i++){
+      rate = good + (bad - good) / 2;
+      result = run(opts, rate, latency);
+      if(result < 0) return 1;
+      if(result) good = rate;
+      else bad = rate;
+   }
+   printf("max sustained: %u keys/s\n", good);
+   return 0;
+}
+
+/** @brief Replays the traffic without threads and collects the events into out[]
+ *  @return the number of events
+ */
+static size_t check_run(const struct options *opts, const struct edge *edges, size_t n, struct result *r,
+                        struct dtmf_event *out, size_t size, __u32 cursor){
+   struct replay rp;
+   size_t count = 0;
+   __u32 head;
+
+   if(replay_init(&rp, opts, r)){
+      replay_free(&rp);
+      return 0;
+   }
+   replay_traffic(&rp, edges, n);
+   head = rp.ring->head;
+   while(cursor != head && count < size){
+      if(dtmf_ring_read(rp.ring, cursor, &out[count]) < 0)
+         dtmf_core_ring_lost(head, RING_SLOTS, cursor, 0, &out[count]);
+      cursor += dtmf_core_ring_skip(&out[count]);
+      count++;
+   }
+   replay_free(&rp);
+   return count;
+}
+
+/** @brief Traffic for the checks, one key every 100 ms */
+static size_t check_traffic(struct options *opts, const char *keys, struct edge **edges){
+   opts->keys = keys;
+   opts->count = strlen(keys);
+   return traffic_generate(opts, 100000000, edges);
+}
+
+static int failures;
+
+static void check(bool ok, const char *what){
+   printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+   if(!ok) failures++;
+}
+
+/** @brief Checks the core against known answers */
+static int self_test(const struct options *defaults){
+   struct options opts = *defaults;
+   struct dtmf_event ev[RING_SLOTS + 16];
+   struct result r;
+   struct edge *edges;
+   struct dtmf_core_rate rate = { 0, 0 };
+   char digits[RING_SLOTS + 16], keys[RING_SLOTS + 16];
+   size_t n, i, count;
+
+   for(i = 0; i < 16 && dtmf_core_nibble(dtmf_core_key(i)) == (int)i; i++);
+   check(i == 16, "key table round trip");
+   check(dtmf_core_nibble('x') < 0, "not a key");
+   n = check_traffic(&opts, "1234567890*#ABCD", &edges);
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, 16, 0);
+   for(i = 0; i < count; i++) digits[i] = ev[i].type == DTMF_EVENT_DIGIT ? ev[i].digit : '?';
+   digits[count] = 0;
+   check(!strcmp(digits, "1234567890*#ABCD"), "all 16 keys decode in order");
+   check(!r.spurious, "no glitch without noise");
+   free(edges);
+
+   opts.glitchUs = 100;                          // Filtered out, StD is back low when the filter expires
+   n = check_traffic(&opts, "147", &edges);
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, 16, 0);
+   check(count == 3 && r.spurious == 3, "glitch filter drops 100 us pulses");
+   opts.debounceUs = 0;                          // Without the filter every pulse is a key
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, 16, 0);
+   check(count == 6, "pulses decode without the glitch filter");
+   opts = *defaults;
+   free(edges);
+
+   opts.isSequence = true;
+   opts.seqTerminator = '#';
+   n = check_traffic(&opts, "12#34", &edges);
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, 16, 0);
+   check(count == 2 && ev[0].type == DTMF_EVENT_SEQUENCE && ev[0].len == 2 && !memcmp(ev[0].digits, "12", 2) &&
+         ev[0].digit == '#', "sequence completed by the terminator");
+   check(count == 2 && ev[1].len == 2 && !memcmp(ev[1].digits, "34", 2) && !ev[1].digit,
+         "sequence completed by the timeout");
+   check(count == 2 && ev[1].ts_ns == edges[6].ts_ns, "sequence stamped with its first key");
+   free(edges);
+   opts.seqTerminator = 0;
+   opts.seqMaxTimeUs = 250000;                   // Expires 50 ms after the third key, before the fourth
+   n = check_traffic(&opts, "1234", &edges);
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, 16, 0);
+   check(count == 2 && ev[0].len == 3 && !memcmp(ev[0].digits, "123", 3) && !ev[0].digit &&
+         ev[1].len == 1 && ev[1].digits[0] == '4', "sequence completed by the completion timeout");
+   opts.seqTerminator = '#';
+   opts.seqMaxTimeUs = 0;
+   free(edges);
+   n = check_traffic(&opts, "12345678901234567", &edges);
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, 16, 0);
+   check(count == 2 && ev[0].len == DTMF_SEQ_MAX && ev[1].len == 1 && ev[1].digits[0] == '7',
+         "sequence completed when full");
+   opts = *defaults;
+   free(edges);
+
+   opts.patterns = "12,123,23";
+   n = check_traffic(&opts, "1231", &edges);
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, 16, 0);
+   check(count == 3 && ev[0].match.id == 0 && ev[1].match.id == 1 && ev[2].match.id == 2,
+         "overlapping patterns all match");
+   check(count == 3 && ev[1].len == 3 && ev[1].ts_ns == edges[0].ts_ns && ev[1].match.end_ns == edges[4].ts_ns,
+         "match stamped with its first and last key");
+   free(edges);
+   opts.patterns = "12,1x";
+   memset(&r, 0, sizeof(r));
+   check(!check_run(&opts, NULL, 0, &r, ev, 16, 0), "pattern that is not made of keys is refused");
+   opts = *defaults;
+
+   for(i = 0; i < RING_SLOTS + 10; i++) keys[i] = "0123456789"[i % 10];
+   keys[i] = 0;
+   n = check_traffic(&opts, keys, &edges);
+   memset(&r, 0, sizeof(r));
+   count = check_run(&opts, edges, n, &r, ev, RING_SLOTS + 16, 0);
+   check(count == RING_SLOTS && ev[0].type == DTMF_EVENT_LOST && ev[0].lost.count == 11 && ev[1].seq == 11,
+         "a reader more than a ring behind gets one lost record");
+   opts = *defaults;
+   free(edges);
+
+   check(dtmf_core_hist_bucket(0, 40) == 0 && dtmf_core_hist_bucket(1, 40) == 1 &&
+         dtmf_core_hist_bucket(1000, 40) == 10 && dtmf_core_hist_bucket(~0ULL, 40) == 39, "histogram buckets");
+   dtmf_core_rate_reset(&rate, 0);
+   for(i = 0; i < 300; i++) dtmf_core_rate_count(&rate, i * 1000, 100000000, 1);
+   check(dtmf_core_rate_count(&rate, 100000000, 100000000, 1) == 300, "rate window count");
+   printf("%d failures\n", failures);
+   return failures ? 1 : 0;
+}
+
+static void usage(void){
+   fprintf(stderr,
+      "usage: dtmf_replay [options]\n"
+      "  -t          check the core against known answers\n"
+      "  -n count    keys dialed per run (10000)\n"
+      "  -r rate     keys per second, 0 replays as fast as possible (100)\n"
+      "              with -f, any other rate replays the trace in real time\n"
+      "  -R          raise the rate until the traffic does not get through\n"
+      "  -u percent  part of the key period that the tone lasts (50)\n"
+      "  -k keys     the keys dialed, over and over (1234567890*#ABCD)\n"
+      "  -D us       window of the glitch filter, 0 for none (2000)\n"
+      "  -G us       a StD pulse this long in every pause, 0 for none (0)\n"
+      "  -x rate     IRQs per second counted as a storm (2000)\n"
+      "  -s          collect the keys into sequences\n"
+      "  -e key      key that completes a sequence, - for none (#)\n"
+      "  -S us       inter-digit timeout of sequences and patterns (3000000)\n"
+      "  -M us       completion timeout of sequences from the first key, 0 for none (0)\n"
+      "  -p a,b,...  match these patterns\n"
+      "  -c us       time the consumer spends on every event (0)\n"
+      "  -f file     replay a recorded trace of \"ns std q4..q1\" lines\n"
+      "  -g dir      drive the gpio-sim chip at dir (/sys/devices/platform/gpio-sim.N/gpiochipM) ...\n"
+      "  -d dev      ... and read the events of the receiver wired to it from dev\n");
+}
+
+/** @brief Tells if a string is made of DTMF keys only */
+static bool keys_valid(const char *keys){
+   for(; *keys; keys++)
+      if(dtmf_core_nibble(*keys) < 0) return false;
+   return true;
+}
+
+int main(int argc, char *argv[]){
+   struct options opts = {
+      .count = 10000, .rate = 100, .duty = 50, .debounceUs = 2000, .stormThreshold = 2000,
+      .keys = "1234567890*#ABCD", .seqTerminator = '#', .seqTimeoutUs = 3000000,
+   };
+   bool test = false;
+   __u64 *latency;
+   int opt, result;
+
+   while((opt = getopt(argc, argv, "tn:r:Ru:k:D:G:x:se:S:M:p:c:f:g:d:h")) != -1){
+      switch(opt){
+      case 't': test = true; break;
+      case 'n': opts.count = strtoul(optarg, NULL, 0); break;
+      case 'r': opts.rate = strtoul(optarg, NULL, 0); break;
+      case 'R': opts.ramp = true; break;
+      case 'u': opts.duty = strtoul(optarg, NULL, 0); break;
+      case 'k': opts.keys = optarg; break;
+      case 'D': opts.debounceUs = strtoul(optarg, NULL, 0); break;
+      case 'G': opts.glitchUs = strtoul(optarg, NULL, 0); break;
+      case 'x': opts.stormThreshold = strtoul(optarg, NULL, 0); break;
+      case 's': opts.isSequence = true; break;
+      case 'e': opts.seqTerminator = optarg[0] == '-' ? 0 : optarg[0]; break;
+      case 'S': opts.seqTimeoutUs = strtoul(optarg, NULL, 0); break;
+      case 'M': opts.seqMaxTimeUs = strtoul(optarg, NULL, 0); break;
+      case 'p': opts.patterns = optarg; break;
+      case 'c': opts.consumerUs = strtoul(optarg, NULL, 0); break;
+      case 'f': opts.file = optarg; break;
+      case 'g': opts.simDir = optarg; break;
+      case 'd': opts.device = optarg; break;
+      default: usage(); return 2;
+      }
+   }
+   if(test) return self_test(&opts);
+   if(!opts.count || opts.duty < 1 || opts.duty > 99 || !*opts.keys || strlen(opts.keys) > MAX_KEYS ||
+      !keys_valid(opts.keys) || !opts.simDir != !opts.device ||
+      (opts.simDir && !opts.rate && !opts.ramp)){
+      usage();
+      return 2;
+   }
+   latency = malloc(opts.count * 2 * sizeof(*latency));
+   if(!latency) return 1;
+   prctl(PR_SET_TIMERSLACK, 1UL);                // The edges are due to the us, not 50 us late
+   if(opts.ramp) result = ramp(&opts, latency);
+   else result = run(&opts, opts.rate, latency) != 1;   // Also fails if the traffic did not get through
+   free(latency);
+   return result;
+}